@@ -0,0 +1,211 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Count and density aggregate queries over the KD-Tree.
+ *
+ * Every node stores the size and bounding box of its subtree. A subtree whose
+ * box lies entirely inside the query region contributes its size without being
+ * visited, and one whose box misses the region is skipped, so only nodes along
+ * the region boundary are touched. Distinct question counts cannot be summed
+ * across subtrees, so those still enumerate the topics inside the region,
+ * deduplicating questions with a QuestionBitmap.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "./epoch.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::max;
+using std::min;
+using std::vector;
+
+namespace {
+
+class CircleRegion {
+ public:
+  CircleRegion(const vector<double> &center, double radius) :
+    center(center), radius(radius) {}
+
+  bool containsPoint(double x, double y) const {
+    return hypot(x - center[0], y - center[1]) <= radius;
+  }
+  bool containsBox(const Node::Box &box) const {
+    double dx = max(fabs(box.minCorner[0] - center[0]),
+                    fabs(box.maxCorner[0] - center[0]));
+    double dy = max(fabs(box.minCorner[1] - center[1]),
+                    fabs(box.maxCorner[1] - center[1]));
+    return hypot(dx, dy) <= radius;
+  }
+  bool missesBox(const Node::Box &box) const {
+    return box.distanceTo(center) > radius;
+  }
+
+ private:
+  const vector<double> &center;
+  double radius;
+};
+
+class BoxRegion {
+ public:
+  BoxRegion(const vector<double> &minCorner, const vector<double> &maxCorner) :
+    minCorner(minCorner), maxCorner(maxCorner) {}
+
+  bool containsPoint(double x, double y) const {
+    return minCorner[0] <= x && x <= maxCorner[0] &&
+      minCorner[1] <= y && y <= maxCorner[1];
+  }
+  bool containsBox(const Node::Box &box) const {
+    return containsPoint(box.minCorner[0], box.minCorner[1]) &&
+      containsPoint(box.maxCorner[0], box.maxCorner[1]);
+  }
+  bool missesBox(const Node::Box &box) const {
+    return box.maxCorner[0] < minCorner[0] || maxCorner[0] < box.minCorner[0] ||
+      box.maxCorner[1] < minCorner[1] || maxCorner[1] < box.minCorner[1];
+  }
+
+ private:
+  const vector<double> &minCorner;
+  const vector<double> &maxCorner;
+};
+
+}  // namespace
+
+template <typename Region>
+int KDTree::countTopics(const Node *currentNode, const Region &region) const {
+  if (currentNode == nullptr)
+    return 0;
+  const Node::Box box = currentNode->getBox();
+  if (region.missesBox(box))
+    return 0;
+  if (region.containsBox(box))
+    return currentNode->getSubtreeSize();
+
+  return region.containsPoint(currentNode->topic.getX(),
+                              currentNode->topic.getY()) +
+    countTopics(currentNode->left, region) +
+    countTopics(currentNode->right, region);
+}
+
+template <typename Region>
+void KDTree::collectQuestions(const Node *currentNode, const Region &region,
+                              bool contained, QuestionBitmap *visited,
+                              int *count) const {
+  if (currentNode == nullptr)
+    return;
+  if (!contained) {
+    const Node::Box box = currentNode->getBox();
+    if (region.missesBox(box))
+      return;
+    contained = region.containsBox(box);
+  }
+
+  if (contained || region.containsPoint(currentNode->topic.getX(),
+                                        currentNode->topic.getY())) {
+    for (int questionId : questionIdsOf(currentNode->topic.getId()))
+      *count += visited->insert(questionId);
+  }
+  collectQuestions(currentNode->left, region, contained, visited, count);
+  collectQuestions(currentNode->right, region, contained, visited, count);
+}
+
+int KDTree::countTopics(const vector<double> &center, double radius) const {
+  EpochGuard guard;
+  return countTopics(root, CircleRegion(center, radius));
+}
+
+int KDTree::countTopics(const vector<double> &minCorner,
+                        const vector<double> &maxCorner) const {
+  EpochGuard guard;
+  return countTopics(root, BoxRegion(minCorner, maxCorner));
+}
+
+// The topic count of the region is known cheaply and bounds how many
+// questions can be touched from below, which sizes the visited set.
+int KDTree::countQuestions(const vector<double> &center, double radius) const {
+  EpochGuard guard;
+  CircleRegion region(center, radius);
+  QuestionBitmap visited;
+  visited.configure(maxQuestionId, countTopics(root, region));
+  int count = 0;
+  collectQuestions(root, region, false, &visited, &count);
+  return count;
+}
+
+int KDTree::countQuestions(const vector<double> &minCorner,
+                           const vector<double> &maxCorner) const {
+  EpochGuard guard;
+  BoxRegion region(minCorner, maxCorner);
+  QuestionBitmap visited;
+  visited.configure(maxQuestionId, countTopics(root, region));
+  int count = 0;
+  collectQuestions(root, region, false, &visited, &count);
+  return count;
+}
+
+vector<int> KDTree::densityGrid(const vector<double> &minCorner,
+                                const vector<double> &maxCorner,
+                                int columns, int rows) const {
+  EpochGuard guard;
+  vector<int> counts(max(columns, 0) * max(rows, 0), 0);
+  if (counts.empty())
+    return counts;
+
+  double cellSize[2] = {(maxCorner[0] - minCorner[0]) / columns,
+                        (maxCorner[1] - minCorner[1]) / rows};
+  densityGrid(root, minCorner.data(), cellSize, columns, rows, &counts);
+  return counts;
+}
+
+void KDTree::densityGrid(const Node *currentNode, const double *minCorner,
+                         const double *cellSize, int columns, int rows,
+                         vector<int> *counts) const {
+  if (currentNode == nullptr)
+    return;
+
+  // Position of a coordinate along one axis in cells from the grid corner.
+  auto offsetOf = [&](double coordinate, int dimension) {
+    return (coordinate - minCorner[dimension]) / cellSize[dimension];
+  };
+  // Cell of a coordinate along one axis, or -1 outside the grid. The far
+  // edge of the grid belongs to the last cell.
+  auto cellOf = [&](double coordinate, int dimension, int numCells) {
+    double offset = offsetOf(coordinate, dimension);
+    if (!(offset >= 0.0) || offset > numCells)
+      return -1;
+    return min(static_cast<int>(offset), numCells - 1);
+  };
+
+  // Subtrees whose box misses the grid have nothing to count.
+  const Node::Box box = currentNode->getBox();
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    int numCells = dimension == 0 ? columns : rows;
+    double offset1 = offsetOf(box.minCorner[dimension], dimension);
+    double offset2 = offsetOf(box.maxCorner[dimension], dimension);
+    if (max(offset1, offset2) < 0.0 || min(offset1, offset2) > numCells)
+      return;
+  }
+
+  int minColumn = cellOf(box.minCorner[0], 0, columns);
+  int maxColumn = cellOf(box.maxCorner[0], 0, columns);
+  int minRow = cellOf(box.minCorner[1], 1, rows);
+  int maxRow = cellOf(box.maxCorner[1], 1, rows);
+  if (minColumn >= 0 && minColumn == maxColumn &&
+      minRow >= 0 && minRow == maxRow) {
+    (*counts)[minRow * columns + minColumn] += currentNode->getSubtreeSize();
+    return;
+  }
+
+  int column = cellOf(currentNode->topic.getX(), 0, columns);
+  int row = cellOf(currentNode->topic.getY(), 1, rows);
+  if (column >= 0 && row >= 0)
+    ++(*counts)[row * columns + column];
+
+  densityGrid(currentNode->left, minCorner, cellSize, columns, rows, counts);
+  densityGrid(currentNode->right, minCorner, cellSize, columns, rows, counts);
+}
+
+}  // namespace NearbySolver
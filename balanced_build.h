@@ -0,0 +1,46 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Median splits shared by the balanced KD-Tree builds.
+ */
+
+#ifndef _BALANCED_BUILD_H
+#define _BALANCED_BUILD_H
+
+#include <algorithm>
+
+namespace NearbySolver {
+
+// Moves the median of [first, last) along the dimension to the middle of
+// the range, with no item before it greater and none after it smaller along
+// that dimension, and returns the middle. coordinate(item, dimension) reads
+// an item's coordinate.
+template <typename Iterator, typename Coordinate>
+Iterator splitAtMedian(Iterator first, Iterator last, int dimension,
+                       Coordinate coordinate) {
+  Iterator middle = first + (last - first) / 2;
+  std::nth_element(first, middle, last,
+                   [dimension, &coordinate](const auto &item1,
+                                            const auto &item2) {
+                     return coordinate(item1, dimension) <
+                       coordinate(item2, dimension);
+                   });
+  return middle;
+}
+
+// Orders [first, last) as an implicit balanced KD-Tree: the middle of every
+// range is the median of the range along the axis given by the parity of
+// its depth, and the halves on either side of it are the subtrees.
+template <typename Iterator, typename Coordinate>
+void buildBalanced(Iterator first, Iterator last, int depth,
+                   Coordinate coordinate) {
+  if (last - first <= 1)
+    return;
+
+  Iterator middle = splitAtMedian(first, last, depth & 1, coordinate);
+  buildBalanced(first, middle, depth + 1, coordinate);
+  buildBalanced(middle + 1, last, depth + 1, coordinate);
+}
+
+}  // namespace NearbySolver
+
+#endif  // _BALANCED_BUILD_H
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Level-of-detail cluster queries for zoomed-out views of a box.
+ *
+ * The tree is walked one level at a time, keeping the frontier of subtrees
+ * whose bounding boxes intersect the box, until the next level would have
+ * more than the allowed number of them. Each frontier subtree becomes one
+ * cluster from the count and coordinate sums every node keeps, so the work
+ * grows with the number of clusters and the depth, not with the topics.
+ *
+ * A node above the frontier holds a topic of its own that no frontier
+ * subtree contains. When the topic lies in the box it is folded into the
+ * first cluster below the node, or kept as a cluster by itself when nothing
+ * below the node intersects the box.
+ */
+
+#include <vector>
+
+#include "./epoch.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::vector;
+
+namespace {
+
+// A frontier subtree, or just the folded topics once node is null, with
+// the topics folded into it from above.
+class FrontierEntry {
+ public:
+  const Node *node = nullptr;
+  int extraCount = 0;
+  double extraSums[2] = {0.0, 0.0};
+};
+
+bool boxMisses(const vector<double> &minCorner,
+               const vector<double> &maxCorner, const double *boxMin,
+               const double *boxMax) {
+  return boxMax[0] < minCorner[0] || maxCorner[0] < boxMin[0] ||
+    boxMax[1] < minCorner[1] || maxCorner[1] < boxMin[1];
+}
+
+}  // namespace
+
+vector<TopicCluster> KDTree::clusters(const vector<double> &minCorner,
+                                      const vector<double> &maxCorner,
+                                      int maxClusters) const {
+  EpochGuard guard;
+  vector<FrontierEntry> frontier, nextFrontier;
+  const Node *top = root;
+  if (top != nullptr && maxClusters > 0 &&
+      !boxMisses(minCorner, maxCorner, top->getBox().minCorner,
+                 top->getBox().maxCorner)) {
+    frontier.emplace_back();
+    frontier.back().node = top;
+  }
+
+  while (true) {
+    nextFrontier.clear();
+    bool expanded = false;
+    for (const FrontierEntry &entry : frontier) {
+      if (entry.node == nullptr) {
+        nextFrontier.push_back(entry);
+        continue;
+      }
+      expanded = true;
+
+      FrontierEntry folded = entry;
+      folded.node = nullptr;
+      const Topic &topic = entry.node->topic;
+      if (minCorner[0] <= topic.getX() && topic.getX() <= maxCorner[0] &&
+          minCorner[1] <= topic.getY() && topic.getY() <= maxCorner[1]) {
+        ++folded.extraCount;
+        folded.extraSums[0] += topic.getX();
+        folded.extraSums[1] += topic.getY();
+      }
+
+      for (const Node *child : {entry.node->left.load(),
+                                entry.node->right.load()}) {
+        if (child == nullptr)
+          continue;
+        const Node::Box box = child->getBox();
+        if (boxMisses(minCorner, maxCorner, box.minCorner, box.maxCorner))
+          continue;
+        folded.node = child;
+        nextFrontier.push_back(folded);
+        folded = FrontierEntry();
+      }
+      if (folded.extraCount > 0)
+        nextFrontier.push_back(folded);
+    }
+
+    if (!expanded || static_cast<int>(nextFrontier.size()) > maxClusters)
+      break;
+    frontier.swap(nextFrontier);
+  }
+
+  vector<TopicCluster> result;
+  for (const FrontierEntry &entry : frontier) {
+    int count = entry.extraCount;
+    double sums[2] = {entry.extraSums[0], entry.extraSums[1]};
+    if (entry.node != nullptr) {
+      count += entry.node->getSubtreeSize();
+      sums[0] += entry.node->getCoordinateSum(0);
+      sums[1] += entry.node->getCoordinateSum(1);
+    }
+    result.emplace_back(sums[0] / count, sums[1] / count, count);
+  }
+  return result;
+}
+
+}  // namespace NearbySolver
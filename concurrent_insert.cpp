@@ -0,0 +1,150 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Concurrent inserts into the KD-Tree and rebalancing behind readers.
+ *
+ * An insert builds its leaf completely, then descends from the root and
+ * publishes the leaf into the first empty child link on its path with a
+ * compare-and-swap. A failed swap means another insert claimed that link
+ * first; the descent simply continues below the node it published. Since a
+ * link only ever changes from null to a finished node, a reader that loads it
+ * sees either no subtree or the whole new one. Subtree sizes, bounding boxes
+ * and time spans along the path are widened before the leaf is published, so
+ * a reader pruning on them may visit a subtree the new topic is not yet in,
+ * but never skips one it is in. Coordinate sums are added the same way, so a
+ * centroid may briefly disagree with its count. Widening uses the compiler's
+ * atomic builtins on the plain fields, and searches read them through Node's
+ * accessors, which load them atomically too.
+ *
+ * Rebalancing builds a new tree off to the side and swaps the root, and the
+ * old nodes are handed to the epoch manager to be freed once no reader that
+ * could still be traversing them remains.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "./balanced_build.h"
+#include "./epoch.h"
+#include "./nearby.h"
+#include "./probes.h"
+
+namespace NearbySolver {
+
+using std::vector;
+
+static void widenMin(double *target, double value) {
+  double current;
+  __atomic_load(target, &current, __ATOMIC_RELAXED);
+  while (value < current &&
+         !__atomic_compare_exchange(target, &current, &value, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static void widenMax(double *target, double value) {
+  double current;
+  __atomic_load(target, &current, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange(target, &current, &value, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static void addTo(double *target, double value) {
+  double current, sum;
+  __atomic_load(target, &current, __ATOMIC_RELAXED);
+  do {
+    sum = current + value;
+  } while (!__atomic_compare_exchange(target, &current, &sum, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void KDTree::insertConcurrent(const Topic &topic) {
+  Node *leaf = new Node(topic);
+  Node *currentNode = nullptr;
+  if (root.compare_exchange_strong(currentNode, leaf))
+    return;
+
+  for (int depth = 0; ; ++depth) {
+    __atomic_fetch_add(&currentNode->subtreeSize, 1, __ATOMIC_RELAXED);
+    for (int dimension = 0; dimension < 2; ++dimension) {
+      widenMin(&currentNode->minCoordinates[dimension],
+               topic.coordinateAt(dimension));
+      widenMax(&currentNode->maxCoordinates[dimension],
+               topic.coordinateAt(dimension));
+      addTo(&currentNode->coordinateSums[dimension],
+            topic.coordinateAt(dimension));
+    }
+    widenMin(&currentNode->minCreatedAt, topic.getCreatedAt());
+    widenMax(&currentNode->maxExpiresAt, topic.getExpiresAt());
+
+    int depthParity = depth & 1;
+    atomic<Node*> &child = topic.coordinateAt(depthParity) <
+      currentNode->topic.coordinateAt(depthParity) ?
+      currentNode->left : currentNode->right;
+    Node *nextNode = nullptr;
+    if (child.compare_exchange_strong(nextNode, leaf))
+      return;
+    currentNode = nextNode;
+  }
+}
+
+void KDTree::collectTopics(const Node *currentNode,
+                           vector<Topic> *result) const {
+  if (currentNode == nullptr)
+    return;
+
+  result->push_back(currentNode->topic);
+  collectTopics(currentNode->left, result);
+  collectTopics(currentNode->right, result);
+}
+
+// Balanced subtree over allTopics[begin, end). The median along the
+// splitting axis becomes the root, moved down to the first topic sharing
+// its coordinate so that every topic on the right is no less than it, as
+// insert and remove expect.
+Node* KDTree::build(vector<Topic> *allTopics, int begin, int end,
+                    int depth) {
+  if (begin >= end)
+    return nullptr;
+
+  int depthParity = depth & 1;
+  auto first = allTopics->begin() + begin, last = allTopics->begin() + end;
+  auto median = splitAtMedian(first, last, depthParity,
+                              [](const Topic &topic, int dimension) {
+                                return topic.coordinateAt(dimension);
+                              });
+  double split = median->coordinateAt(depthParity);
+  auto pivot = std::partition(first, median, [&](const Topic &topic) {
+    return topic.coordinateAt(depthParity) < split;
+  });
+  std::iter_swap(pivot, median);
+
+  int middle = static_cast<int>(pivot - allTopics->begin());
+  Node *currentNode = new Node((*allTopics)[middle]);
+  // Published only by the exchange of the root in rebalance.
+  currentNode->left.store(build(allTopics, begin, middle, depth + 1),
+                          std::memory_order_relaxed);
+  currentNode->right.store(build(allTopics, middle + 1, end, depth + 1),
+                           std::memory_order_relaxed);
+  updateSummary(currentNode);
+  return currentNode;
+}
+
+void KDTree::rebalance() {
+  NEARBY_PROBE1(rebalance__start, size());
+  vector<Topic> allTopics;
+  allTopics.reserve(size());
+  collectTopics(root, &allTopics);
+
+  // The jump table points into the old nodes, so it is retired first.
+  bool hadJumpTable = jumpTable != nullptr;
+  dropJumpTable();
+  Node *oldRoot = root.exchange(
+    build(&allTopics, 0, static_cast<int>(allTopics.size()), 0));
+  if (oldRoot != nullptr)
+    epochs.retire([this, oldRoot]() { freeNodes(oldRoot); });
+  if (hadJumpTable)
+    buildJumpTable();
+  NEARBY_PROBE1(rebalance__end, allTopics.size());
+}
+
+}  // namespace NearbySolver
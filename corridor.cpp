@@ -0,0 +1,172 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Corridor queries: topics within a distance of a polyline route.
+ *
+ * Each node keeps the list of route segments that can still be within range
+ * of its subtree. A segment is dropped once its bounding box, grown by the
+ * search radius, misses the subtree's box, or once the exact box-to-segment
+ * distance exceeds the radius. Long routes therefore shrink to the few nearby
+ * segments after a couple of levels, and a subtree with no segment left is
+ * pruned. Once k topics are found, the radius tightens to the current k-th
+ * distance as results come in.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "./epoch.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::vector;
+
+namespace {
+
+class Segment {
+ public:
+  Segment(const vector<vector<double>> &route, int index) :
+    start(route[index]),
+    end(route[min(index + 1, static_cast<int>(route.size()) - 1)]) {}
+
+  double distanceTo(double x, double y) const {
+    double dx = end[0] - start[0], dy = end[1] - start[1];
+    double lengthSquared = dx * dx + dy * dy;
+    double t = lengthSquared > 0.0 ?
+      ((x - start[0]) * dx + (y - start[1]) * dy) / lengthSquared : 0.0;
+    t = max(0.0, min(1.0, t));
+    return hypot(x - (start[0] + t * dx), y - (start[1] + t * dy));
+  }
+
+  // Cheap rejection: the segment's bounding box grown by radius misses the
+  // box.
+  bool boundsMiss(const Node::Box &box, double radius) const {
+    for (int dimension = 0; dimension < 2; ++dimension) {
+      if (min(start[dimension], end[dimension]) - radius >
+          box.maxCorner[dimension] ||
+          max(start[dimension], end[dimension]) + radius <
+          box.minCorner[dimension])
+        return true;
+    }
+    return false;
+  }
+
+  // Exact distance between the segment and a box: zero if they intersect,
+  // otherwise attained at an endpoint of the segment or a corner of the box.
+  double distanceTo(const Node::Box &box) const {
+    if (clips(box))
+      return 0.0;
+
+    double distance = min(box.distanceTo(start), box.distanceTo(end));
+    for (double x : {box.minCorner[0], box.maxCorner[0]}) {
+      for (double y : {box.minCorner[1], box.maxCorner[1]})
+        distance = min(distance, distanceTo(x, y));
+    }
+    return distance;
+  }
+
+ private:
+  const vector<double> &start;
+  const vector<double> &end;
+
+  // Liang-Barsky clipping of the segment against the box.
+  bool clips(const Node::Box &box) const {
+    double tMin = 0.0, tMax = 1.0;
+    for (int dimension = 0; dimension < 2; ++dimension) {
+      double delta = end[dimension] - start[dimension];
+      if (delta == 0.0) {
+        if (start[dimension] < box.minCorner[dimension] ||
+            start[dimension] > box.maxCorner[dimension])
+          return false;
+        continue;
+      }
+      double t1 = (box.minCorner[dimension] - start[dimension]) / delta;
+      double t2 = (box.maxCorner[dimension] - start[dimension]) / delta;
+      tMin = max(tMin, min(t1, t2));
+      tMax = min(tMax, max(t1, t2));
+      if (tMin > tMax)
+        return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
+vector<int> KDTree::corridorTopics(const vector<vector<double>> &route,
+                                   double maxDistance, int k) const {
+  vector<int> topicIds;
+  if (route.empty() || k <= 0)
+    return topicIds;
+
+  EpochGuard guard;
+  // The segments still in range of each node on the current path, stacked
+  // one range per level.
+  vector<int> segments(max(static_cast<int>(route.size()) - 1, 1));
+  for (int index = 0; index < static_cast<int>(segments.size()); ++index)
+    segments[index] = index;
+  vector<DistanceResult> results;
+  corridorTopics(root, route, 0, static_cast<int>(segments.size()),
+                 &segments, maxDistance, k, &results);
+
+  std::sort_heap(results.begin(), results.end(), closerResult);
+  for (const auto &result : results)
+    topicIds.push_back(result.second);
+  return topicIds;
+}
+
+// The segments of the parent are segments[begin, end); those near this
+// subtree are pushed above them for the children and popped on return.
+void KDTree::corridorTopics(const Node *currentNode,
+                            const vector<vector<double>> &route,
+                            int begin, int end, vector<int> *segments,
+                            double maxDistance, int k,
+                            vector<DistanceResult> *results) const {
+  if (currentNode == nullptr)
+    return;
+
+  double radius = maxDistance;
+  if (static_cast<int>(results->size()) >= k)
+    radius = min(radius, results->front().first);
+
+  const Node::Box box = currentNode->getBox();
+  for (int i = begin; i < end; ++i) {
+    Segment segment(route, (*segments)[i]);
+    if (!segment.boundsMiss(box, radius + EPSILON) &&
+        !compareDouble(segment.distanceTo(box), radius))
+      segments->push_back((*segments)[i]);
+  }
+  int nearEnd = static_cast<int>(segments->size());
+  if (nearEnd == end)
+    return;
+
+  double distance = numeric_limits<double>::infinity();
+  for (int i = end; i < nearEnd; ++i) {
+    distance = min(distance, Segment(route, (*segments)[i]).distanceTo(
+        currentNode->topic.getX(), currentNode->topic.getY()));
+  }
+  if (distance <= maxDistance) {
+    DistanceResult result(distance, currentNode->topic.getId());
+    if (static_cast<int>(results->size()) < k) {
+      results->push_back(result);
+      std::push_heap(results->begin(), results->end(), closerResult);
+    } else if (closerResult(result, results->front())) {
+      std::pop_heap(results->begin(), results->end(), closerResult);
+      results->back() = result;
+      std::push_heap(results->begin(), results->end(), closerResult);
+    }
+  }
+
+  corridorTopics(currentNode->left, route, end, nearEnd, segments,
+                 maxDistance, k, results);
+  corridorTopics(currentNode->right, route, end, nearEnd, segments,
+                 maxDistance, k, results);
+  segments->resize(end);
+}
+
+}  // namespace NearbySolver
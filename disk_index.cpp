@@ -0,0 +1,491 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Disk-resident KD-Tree read through a bounded buffer pool.
+ *
+ * File layout, native endian, in blocks of blockBytes: block 0 holds the
+ * magic, version, block size, block count, root child and topic count. Every
+ * other block starts with its kind and entry count; a leaf block then holds
+ * (x, y, topic id) entries, an inner block split nodes with two children. The
+ * splits are medians with no topic of their own, so points equal to a split
+ * may lie on either side, which the plane distance bound still covers.
+ *
+ * Inner blocks are filled breadth first from their root range, so each one
+ * holds the top levels of its subtree and a search crosses about log base
+ * (block fanout) of the topic count blocks. When a search descends to the
+ * near child of a node whose far child is another block that it may still
+ * have to visit, it prefetches that block, overlapping the read with the work
+ * on the near side.
+ */
+
+#include "./disk_index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./balanced_build.h"
+#include "./metrics.h"
+
+namespace NearbySolver {
+
+using std::deque;
+using std::lock_guard;
+using std::string;
+using std::vector;
+
+constexpr uint32_t DiskIndex::MAGIC;
+constexpr uint32_t DiskIndex::VERSION;
+constexpr int DiskIndex::MIN_BLOCK_BYTES;
+constexpr int DiskIndex::MAX_BLOCK_BYTES;
+constexpr int32_t DiskIndex::EMPTY;
+constexpr int32_t DiskIndex::LEAF_BLOCK;
+constexpr int32_t DiskIndex::INNER_BLOCK;
+
+namespace {
+
+// Size of the kind and count at the start of a block.
+constexpr int BLOCK_HEADER_BYTES = 8;
+
+bool readBlock(int fd, int blockBytes, int blockId, char *data) {
+  off_t offset = static_cast<off_t>(blockId) * blockBytes;
+  int done = 0;
+  while (done < blockBytes) {
+    ssize_t result = pread(fd, data + done, blockBytes - done, offset + done);
+    if (result <= 0)
+      return false;
+    done += static_cast<int>(result);
+  }
+  return true;
+}
+
+bool writeBlock(int fd, int blockBytes, int blockId, const char *data) {
+  off_t offset = static_cast<off_t>(blockId) * blockBytes;
+  int done = 0;
+  while (done < blockBytes) {
+    ssize_t result = pwrite(fd, data + done, blockBytes - done, offset + done);
+    if (result < 0)
+      return false;
+    done += static_cast<int>(result);
+  }
+  return true;
+}
+
+}  // namespace
+
+BufferPool::BufferPool(int fd, int blockBytes, int capacity) :
+  fd(fd), blockBytes(blockBytes), capacity(std::max(capacity, 1)),
+  frames(this->capacity) {
+  for (Frame &frame : frames)
+    frame.data.resize(blockBytes);
+}
+
+const char* BufferPool::pin(int blockId) {
+  lock_guard<mutex> lock(poolMutex);
+  auto iter = frameOf.find(blockId);
+  if (iter != frameOf.end()) {
+    ++hits;
+    Frame &frame = frames[iter->second];
+    ++frame.pinCount;
+    frame.referenced = true;
+    return frame.data.data();
+  }
+
+  ++misses;
+  int index = victim();
+  Frame &frame = frames[index];
+  if (frame.blockId >= 0)
+    frameOf.erase(frame.blockId);
+  frame.blockId = -1;
+  if (!readBlock(fd, blockBytes, blockId, frame.data.data())) {
+    giveBack(index);
+    return nullptr;
+  }
+  frame.blockId = blockId;
+  frame.pinCount = 1;
+  frame.referenced = true;
+  frameOf[blockId] = index;
+  return frame.data.data();
+}
+
+void BufferPool::unpin(int blockId) {
+  lock_guard<mutex> lock(poolMutex);
+  auto iter = frameOf.find(blockId);
+  if (iter != frameOf.end() && --frames[iter->second].pinCount == 0)
+    giveBack(iter->second);
+}
+
+void BufferPool::prefetch(int blockId) {
+  {
+    lock_guard<mutex> lock(poolMutex);
+    if (frameOf.count(blockId))
+      return;
+  }
+  posix_fadvise(fd, static_cast<off_t>(blockId) * blockBytes, blockBytes,
+                POSIX_FADV_WILLNEED);
+}
+
+// Next unpinned frame whose reference bit is clear, clearing the bits it
+// passes; two sweeps find one unless every frame is pinned.
+int BufferPool::victim() {
+  int numFrames = static_cast<int>(frames.size());
+  for (int step = 0; step < 2 * numFrames; ++step) {
+    Frame &frame = frames[clockHand];
+    int index = clockHand;
+    clockHand = (clockHand + 1) % numFrames;
+    if (frame.pinCount > 0)
+      continue;
+    if (!frame.referenced)
+      return index;
+    frame.referenced = false;
+  }
+  frames.emplace_back();
+  frames.back().data.resize(blockBytes);
+  return numFrames;
+}
+
+// Drops the unpinned frame at index if the pool has grown past capacity,
+// moving the last frame into its place. Moving a frame keeps its data where
+// it is, so the block of a pinned frame stays valid for whoever pinned it.
+void BufferPool::giveBack(int index) {
+  int numFrames = static_cast<int>(frames.size());
+  if (numFrames <= capacity)
+    return;
+  if (frames[index].blockId >= 0)
+    frameOf.erase(frames[index].blockId);
+  if (index != numFrames - 1) {
+    frames[index] = std::move(frames.back());
+    if (frames[index].blockId >= 0)
+      frameOf[frames[index].blockId] = index;
+  }
+  frames.pop_back();
+  clockHand %= numFrames - 1;
+}
+
+// Writes blocks depth first, reserving a block's number before its
+// children so that the children can be referenced from it.
+class DiskIndex::Writer {
+ public:
+  Writer(int fd, int blockBytes) : fd(fd), blockBytes(blockBytes),
+    leafCapacity((blockBytes - BLOCK_HEADER_BYTES) / sizeof(LeafEntry)),
+    innerCapacity((blockBytes - BLOCK_HEADER_BYTES) / sizeof(InnerEntry)) {}
+
+  vector<LeafEntry> points;
+  int numBlocks = 1;
+  bool failed = false;
+
+  int32_t writeRange(int begin, int end, int depth) {
+    if (begin >= end)
+      return EMPTY;
+    int blockId = numBlocks++;
+    vector<char> block(blockBytes, 0);
+    int32_t kind, count;
+
+    if (end - begin <= leafCapacity) {
+      kind = LEAF_BLOCK;
+      count = end - begin;
+      memcpy(block.data() + BLOCK_HEADER_BYTES, points.data() + begin,
+             count * sizeof(LeafEntry));
+    } else {
+      kind = INNER_BLOCK;
+      vector<InnerEntry> nodes;
+      // Ranges waiting for a node of this block, with the child slot that
+      // refers to them; ranges that do not get one become blocks.
+      class Pending {
+       public:
+        int begin, end, depth, parent, side;
+      };
+      deque<Pending> queue = {{begin, end, depth, -1, 0}};
+      vector<Pending> external;
+      while (!queue.empty()) {
+        Pending range = queue.front();
+        queue.pop_front();
+        int index = static_cast<int>(nodes.size());
+        if (range.parent >= 0)
+          nodes[range.parent].children[range.side] = index;
+
+        int depthParity = range.depth & 1;
+        int middle = static_cast<int>(
+          splitAtMedian(points.begin() + range.begin,
+                        points.begin() + range.end, depthParity,
+                        [](const LeafEntry &entry, int dimension) {
+                          return entry.coordinates[dimension];
+                        }) - points.begin());
+        InnerEntry node;
+        node.split = points[middle].coordinates[depthParity];
+        node.children[0] = node.children[1] = EMPTY;
+        nodes.push_back(node);
+
+        Pending halves[2] = {{range.begin, middle, range.depth + 1, index, 0},
+                             {middle, range.end, range.depth + 1, index, 1}};
+        for (const Pending &half : halves) {
+          int size = half.end - half.begin;
+          if (size > leafCapacity && static_cast<int>(nodes.size() +
+              queue.size()) < innerCapacity) {
+            queue.push_back(half);
+          } else if (size > 0) {
+            external.push_back(half);
+          }
+        }
+      }
+      for (const Pending &half : external) {
+        nodes[half.parent].children[half.side] =
+          writeRange(half.begin, half.end, half.depth);
+      }
+      count = static_cast<int32_t>(nodes.size());
+      memcpy(block.data() + BLOCK_HEADER_BYTES, nodes.data(),
+             count * sizeof(InnerEntry));
+    }
+
+    memcpy(block.data(), &kind, sizeof(kind));
+    memcpy(block.data() + sizeof(kind), &count, sizeof(count));
+    if (!writeBlock(fd, blockBytes, blockId, block.data()))
+      failed = true;
+    return blockChild(blockId);
+  }
+
+ private:
+  int fd;
+  int blockBytes;
+  int leafCapacity;
+  int innerCapacity;
+};
+
+bool DiskIndex::write(const string &path,
+                      const unordered_map<int, Topic> &allTopics,
+                      int blockBytes) {
+  if (blockBytes < MIN_BLOCK_BYTES || blockBytes > MAX_BLOCK_BYTES)
+    return false;
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  Writer writer(fd, blockBytes);
+  writer.points.reserve(allTopics.size());
+  for (const auto &entry : allTopics) {
+    LeafEntry point;
+    point.coordinates[0] = entry.second.getX();
+    point.coordinates[1] = entry.second.getY();
+    point.topicId = entry.first;
+    point.unused = 0;
+    writer.points.push_back(point);
+  }
+  int32_t rootChild = writer.writeRange(
+    0, static_cast<int>(writer.points.size()), 0);
+
+  vector<char> header(blockBytes, 0);
+  int32_t fields[4] = {blockBytes, writer.numBlocks, rootChild,
+                       static_cast<int32_t>(writer.points.size())};
+  memcpy(header.data(), &MAGIC, sizeof(MAGIC));
+  memcpy(header.data() + 4, &VERSION, sizeof(VERSION));
+  memcpy(header.data() + 8, fields, sizeof(fields));
+  bool written = !writer.failed &&
+    writeBlock(fd, blockBytes, 0, header.data()) && fsync(fd) == 0;
+  return ::close(fd) == 0 && written;
+}
+
+DiskIndex::~DiskIndex() {
+  close();
+}
+
+bool DiskIndex::open(const string &path, int poolBlocks, int pinnedLevels) {
+  close();
+  fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  char header[24];
+  uint32_t magic, version;
+  int32_t fields[4];
+  if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+    close();
+    return false;
+  }
+  memcpy(&magic, header, sizeof(magic));
+  memcpy(&version, header + 4, sizeof(version));
+  memcpy(fields, header + 8, sizeof(fields));
+  if (magic != MAGIC || version != VERSION ||
+      fields[0] < MIN_BLOCK_BYTES || fields[0] > MAX_BLOCK_BYTES ||
+      fields[1] < 1 || fields[3] < 0) {
+    close();
+    return false;
+  }
+  blockBytes = fields[0];
+  numBlocks = fields[1];
+  rootChild = fields[2];
+  numTopics = fields[3];
+  struct stat fileStatus;
+  if ((rootChild != EMPTY && (childBlock(rootChild) < 1 ||
+                              childBlock(rootChild) >= numBlocks)) ||
+      fstat(fd, &fileStatus) != 0 ||
+      fileStatus.st_size < static_cast<off_t>(numBlocks) * blockBytes) {
+    close();
+    return false;
+  }
+
+  // Pin the blocks of the first levels, found breadth first.
+  vector<int> level;
+  if (rootChild != EMPTY)
+    level.push_back(childBlock(rootChild));
+  for (int depth = 0; depth < pinnedLevels && !level.empty(); ++depth) {
+    vector<int> nextLevel;
+    for (int blockId : level) {
+      vector<char> &block = pinned[blockId];
+      block.resize(blockBytes);
+      BlockView view;
+      if (!readBlock(fd, blockBytes, blockId, block.data()) ||
+          !checkHeader(blockId, block.data(), &view)) {
+        close();
+        return false;
+      }
+      if (view.kind != INNER_BLOCK)
+        continue;
+      const InnerEntry *nodes = reinterpret_cast<const InnerEntry*>(
+        block.data() + BLOCK_HEADER_BYTES);
+      for (int i = 0; i < view.count; ++i) {
+        for (int32_t child : nodes[i].children) {
+          if (child >= EMPTY)
+            continue;
+          if (childBlock(child) <= blockId || childBlock(child) >= numBlocks) {
+            close();
+            return false;
+          }
+          nextLevel.push_back(childBlock(child));
+        }
+      }
+    }
+    level.swap(nextLevel);
+  }
+
+  pool = new BufferPool(fd, blockBytes, poolBlocks);
+  metrics.watchBufferPool(path, pool);
+  return true;
+}
+
+void DiskIndex::close() {
+  if (pool != nullptr)
+    metrics.unwatchBufferPool(pool);
+  delete pool;
+  pool = nullptr;
+  pinned.clear();
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+  rootChild = EMPTY;
+  numBlocks = 0;
+  numTopics = 0;
+}
+
+// Reads the kind and count of a block and checks that its entries fit in
+// it, so that a corrupt file cannot send a query past the block.
+bool DiskIndex::checkHeader(int blockId, const char *data,
+                            BlockView *block) const {
+  block->blockId = blockId;
+  block->data = data;
+  memcpy(&block->kind, data, sizeof(block->kind));
+  memcpy(&block->count, data + sizeof(block->kind), sizeof(block->count));
+
+  int entryBytes;
+  if (block->kind == LEAF_BLOCK)
+    entryBytes = sizeof(LeafEntry);
+  else if (block->kind == INNER_BLOCK)
+    entryBytes = sizeof(InnerEntry);
+  else
+    return false;
+  return block->count >= (block->kind == INNER_BLOCK ? 1 : 0) &&
+    block->count <= (blockBytes - BLOCK_HEADER_BYTES) / entryBytes;
+}
+
+const char* DiskIndex::fetch(int blockId) const {
+  auto iter = pinned.find(blockId);
+  if (iter != pinned.end())
+    return iter->second.data();
+  return pool->pin(blockId);
+}
+
+void DiskIndex::release(int blockId) const {
+  if (!pinned.count(blockId))
+    pool->unpin(blockId);
+}
+
+bool DiskIndex::kNNTopics(const vector<double> &position, int k,
+                          ResultHeap *results) const {
+  if (fd < 0 || k <= 0)
+    return true;
+  // The header block refers to the root block, as an inner node would.
+  const BlockView header = {0, INNER_BLOCK, 0, nullptr};
+  return kNNTopics(rootChild, header, EMPTY, 0, position, k, results);
+}
+
+// Visits a child of the parent node in the given block: another node of
+// the block, or the root of another block, which is fetched for the
+// duration of the visit. The writer numbers nodes and blocks after those
+// that refer to them, so a child that does not is rejected, as is one past
+// the end of its block or file, and no corrupt file can make a loop.
+bool DiskIndex::kNNTopics(int32_t child, const BlockView &block,
+                          int32_t parent, int depth,
+                          const vector<double> &position, int k,
+                          ResultHeap *results) const {
+  if (child == EMPTY)
+    return true;
+
+  if (child < EMPTY) {
+    int blockId = childBlock(child);
+    if (blockId <= block.blockId || blockId >= numBlocks)
+      return false;
+    const char *data = fetch(blockId);
+    if (data == nullptr)
+      return false;
+    BlockView view;
+    bool valid = checkHeader(blockId, data, &view);
+    if (valid && view.kind == LEAF_BLOCK) {
+      const LeafEntry *entries = reinterpret_cast<const LeafEntry*>(
+        data + BLOCK_HEADER_BYTES);
+      // Most topics of a leaf are clearly farther than the k-th result, and
+      // skipping them saves the push and pop on the heap.
+      for (int i = 0; i < view.count; ++i) {
+        double distance = hypot(position[0] - entries[i].coordinates[0],
+                                position[1] - entries[i].coordinates[1]);
+        if (static_cast<int>(results->size()) >= k &&
+            compareDouble(distance, results->top().first))
+          continue;
+        results->emplace(distance, entries[i].topicId);
+        if (static_cast<int>(results->size()) > k)
+          results->pop();
+      }
+    } else if (valid) {
+      valid = kNNTopics(0, view, EMPTY, depth, position, k, results);
+    }
+    release(blockId);
+    return valid;
+  }
+
+  if (child <= parent || child >= block.count)
+    return false;
+  const InnerEntry &node = reinterpret_cast<const InnerEntry*>(
+    block.data + BLOCK_HEADER_BYTES)[child];
+  double offset = position[depth & 1] - node.split;
+  int32_t nearChild = node.children[offset < 0 ? 0 : 1];
+  int32_t farChild = node.children[offset < 0 ? 1 : 0];
+  auto mayVisitFar = [&]() {
+    return static_cast<int>(results->size()) < k ||
+      fabs(offset) < results->top().first;
+  };
+
+  if (farChild < EMPTY && childBlock(farChild) < numBlocks &&
+      mayVisitFar() && !pinned.count(childBlock(farChild)))
+    pool->prefetch(childBlock(farChild));
+  if (!kNNTopics(nearChild, block, child, depth + 1, position, k, results))
+    return false;
+  return !mayVisitFar() ||
+    kNNTopics(farChild, block, child, depth + 1, position, k, results);
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Disk-resident KD-Tree read through a bounded buffer pool.
+ */
+
+#ifndef _DISK_INDEX_H
+#define _DISK_INDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::mutex;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+class BufferPool;
+class DiskIndex;
+
+// Fixed number of block-sized frames over a file, replaced in CLOCK order.
+// A pinned frame is never replaced; when every frame is pinned the pool
+// grows by one rather than fail, and gives an extra frame back as soon as
+// one is unpinned, so the pool returns to capacity. Prefetching asks the
+// kernel to start reading a block so that a later miss is served from the
+// page cache.
+class BufferPool {
+ public:
+  BufferPool(int fd, int blockBytes, int capacity);
+  ~BufferPool() = default;
+  // Returns the block's data, read with pread on a miss, or nullptr if the
+  // read fails. Every successful pin must be matched by an unpin.
+  const char* pin(int blockId);
+  void unpin(int blockId);
+  void prefetch(int blockId);
+  // Safe to read while other threads pin blocks.
+  int64_t getHits() const { return hits; }
+  int64_t getMisses() const { return misses; }
+
+ private:
+  class Frame {
+   public:
+    int blockId = -1;
+    int pinCount = 0;
+    bool referenced = false;
+    vector<char> data;
+  };
+
+  int fd;
+  int blockBytes;
+  int capacity;
+  vector<Frame> frames;
+  unordered_map<int, int> frameOf;
+  int clockHand = 0;
+  atomic<int64_t> hits{0};
+  atomic<int64_t> misses{0};
+  mutex poolMutex;
+
+  int victim();
+  void giveBack(int index);
+};
+
+// Static KD-Tree over the topics laid out in fixed-size blocks, in the style
+// of a KDB-tree. Leaf blocks hold topics; inner blocks hold a subtree of up
+// to a block's worth of split nodes whose children are either nodes of the
+// same block or other blocks. Blocks near the root are pinned in memory,
+// the rest are read through the buffer pool as queries reach them.
+class DiskIndex {
+ public:
+  static constexpr uint32_t MAGIC = 0x4b534944;  // "DISK"
+  static constexpr uint32_t VERSION = 1;
+  static constexpr int MIN_BLOCK_BYTES = 4 << 10;
+  static constexpr int MAX_BLOCK_BYTES = 64 << 10;
+
+  DiskIndex() = default;
+  ~DiskIndex();
+  DiskIndex(const DiskIndex&) = delete;
+  DiskIndex& operator= (const DiskIndex&) = delete;
+
+  // Writes the topics to a new index file with the given block size.
+  static bool write(const string &path,
+                    const unordered_map<int, Topic> &allTopics,
+                    int blockBytes);
+  // Opens an index, keeping the blocks of the first pinnedLevels levels of
+  // blocks in memory and up to poolBlocks others in the buffer pool. Fails
+  // if the header or a pinned block is malformed or the file is short.
+  bool open(const string &path, int poolBlocks, int pinnedLevels);
+  void close();
+  // Same contract as the reentrant KDTree::kNNTopics, but returns false,
+  // with the results incomplete, if a block cannot be read or is malformed.
+  bool kNNTopics(const vector<double> &position, int k,
+                 ResultHeap *results) const;
+  int size() const { return numTopics; }
+  const BufferPool* getPool() const { return pool; }
+
+ private:
+  // A child is a node of the same block when non-negative, no child when
+  // EMPTY, and block b when encoded as -(b + 2).
+  static constexpr int32_t EMPTY = -1;
+  static constexpr int32_t LEAF_BLOCK = 0;
+  static constexpr int32_t INNER_BLOCK = 1;
+
+  class LeafEntry {
+   public:
+    double coordinates[2];
+    int32_t topicId;
+    int32_t unused;
+  };
+
+  class InnerEntry {
+   public:
+    double split;
+    int32_t children[2];
+  };
+
+  // A fetched block whose header has been checked against the block size.
+  class BlockView {
+   public:
+    int blockId;
+    int32_t kind;
+    int32_t count;
+    const char *data;
+  };
+
+  class Writer;
+
+  int fd = -1;
+  int blockBytes = 0;
+  int numBlocks = 0;
+  int numTopics = 0;
+  int32_t rootChild = EMPTY;
+  unordered_map<int, vector<char>> pinned;
+  BufferPool *pool = nullptr;
+
+  static int32_t blockChild(int blockId) { return -(blockId + 2); }
+  static int childBlock(int32_t child) { return -(child + 2); }
+  bool checkHeader(int blockId, const char *data, BlockView *block) const;
+  const char* fetch(int blockId) const;
+  void release(int blockId) const;
+  bool kNNTopics(int32_t child, const BlockView &block, int32_t parent,
+                 int depth, const vector<double> &position, int k,
+                 ResultHeap *results) const;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _DISK_INDEX_H
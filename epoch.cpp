@@ -0,0 +1,118 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Epoch-based reclamation for memory unlinked while readers may hold it.
+ *
+ * A thread claims one of a fixed number of slots the first time it enters a
+ * critical section and keeps it until it exits. Entering publishes the global
+ * epoch in the slot; retiring unlinked memory advances the global epoch, so
+ * the memory is stamped with an epoch every later reader starts after. All
+ * operations on the epochs and on the structure being read are sequentially
+ * consistent, so a reader whose slot was not yet visible to reclaim() loads
+ * the structure only after the memory was unlinked and cannot reach it.
+ */
+
+#include "./epoch.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+
+namespace NearbySolver {
+
+using std::lock_guard;
+using std::numeric_limits;
+
+constexpr int EpochManager::MAX_THREADS;
+constexpr int EpochManager::RECLAIM_INTERVAL;
+
+EpochManager epochs;
+
+// Slot claimed by the current thread, handed back when the thread ends.
+class EpochThread {
+ public:
+  ~EpochThread() {
+    if (slot >= 0)
+      epochs.slots[slot].used.store(false);
+  }
+
+  int claim() {
+    while (slot < 0) {
+      for (int index = 0; index < EpochManager::MAX_THREADS; ++index) {
+        bool expected = false;
+        if (epochs.slots[index].used.compare_exchange_strong(expected,
+                                                             true)) {
+          slot = index;
+          break;
+        }
+      }
+      if (slot < 0)
+        std::this_thread::yield();
+    }
+    return slot;
+  }
+
+  int slot = -1;
+  int depth = 0;
+};
+
+static thread_local EpochThread epochThread;
+
+EpochManager::~EpochManager() {
+  for (auto &entry : retired)
+    entry.second();
+}
+
+void EpochManager::enter() {
+  if (epochThread.depth++ > 0)
+    return;
+  slots[epochThread.claim()].epoch.store(globalEpoch.load());
+}
+
+void EpochManager::exit() {
+  if (--epochThread.depth > 0)
+    return;
+  slots[epochThread.slot].epoch.store(0);
+}
+
+void EpochManager::retire(function<void()> release) {
+  bool shouldReclaim;
+  {
+    lock_guard<mutex> lock(retiredMutex);
+    retired.emplace_back(globalEpoch.fetch_add(1), std::move(release));
+    shouldReclaim = retired.size() % RECLAIM_INTERVAL == 0;
+  }
+  if (shouldReclaim)
+    reclaim();
+}
+
+void EpochManager::reclaim() {
+  uint64_t oldestActive = numeric_limits<uint64_t>::max();
+  for (const Slot &slot : slots) {
+    uint64_t epoch = slot.epoch.load();
+    if (epoch != 0)
+      oldestActive = std::min(oldestActive, epoch);
+  }
+
+  // Release outside the lock, since releasing a large structure is slow.
+  vector<pair<uint64_t, function<void()>>> ready;
+  {
+    lock_guard<mutex> lock(retiredMutex);
+    auto firstKept = std::stable_partition(
+      retired.begin(), retired.end(),
+      [oldestActive](const pair<uint64_t, function<void()>> &entry) {
+        return entry.first < oldestActive;
+      });
+    ready.assign(std::make_move_iterator(retired.begin()),
+                 std::make_move_iterator(firstKept));
+    retired.erase(retired.begin(), firstKept);
+  }
+  for (auto &entry : ready)
+    entry.second();
+}
+
+size_t EpochManager::pending() const {
+  lock_guard<mutex> lock(retiredMutex);
+  return retired.size();
+}
+
+}  // namespace NearbySolver
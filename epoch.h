@@ -0,0 +1,79 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Epoch-based reclamation for memory unlinked while readers may hold it.
+ */
+
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::function;
+using std::mutex;
+using std::pair;
+using std::vector;
+
+class EpochManager;
+class EpochGuard;
+
+// Readers announce the global epoch they started in; memory retired by a
+// writer is stamped with the epoch it was unlinked in and is released only
+// once every reader still inside a critical section started after that, so
+// no reader can be holding a pointer into it. There is a single instance,
+// epochs, since every thread keeps its slot in thread-local storage.
+class EpochManager {
+ public:
+  static constexpr int MAX_THREADS = 128;
+
+  EpochManager() = default;
+  ~EpochManager();
+  // Critical sections may nest; only the outermost one is announced.
+  void enter();
+  void exit();
+  // Runs release once no reader can reach the unlinked memory anymore.
+  // The memory must already be unreachable from the shared structure.
+  void retire(function<void()> release);
+  // Releases everything retired before the oldest active reader started.
+  void reclaim();
+  size_t pending() const;
+
+ private:
+  class alignas(64) Slot {
+   public:
+    // Epoch the thread entered in, or 0 when it is outside.
+    atomic<uint64_t> epoch{0};
+    atomic<bool> used{false};
+  };
+
+  static constexpr int RECLAIM_INTERVAL = 64;
+
+  atomic<uint64_t> globalEpoch{1};
+  Slot slots[MAX_THREADS];
+  mutable mutex retiredMutex;
+  vector<pair<uint64_t, function<void()>>> retired;
+
+  friend class EpochThread;
+};
+
+extern EpochManager epochs;
+
+// Keeps the calling thread inside a critical section for its lifetime.
+class EpochGuard {
+ public:
+  EpochGuard() { epochs.enter(); }
+  ~EpochGuard() { epochs.exit(); }
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator= (const EpochGuard&) = delete;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _EPOCH_H
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Group nearest queries: topics and questions near any of several points.
+ *
+ * A topic's score is the minimum or the sum of its distances to the query
+ * points. For a subtree, the same combination of the distances from each point
+ * to the subtree's bounding box is a lower bound on the score of every topic
+ * inside it, so one traversal prunes for all points at once. Questions take
+ * the best score among their topics, as in kNNQuestions.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "./epoch.h"
+#include "./group_questions.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::min;
+using std::numeric_limits;
+using std::vector;
+
+static double combine(GroupAggregate aggregate, double total, double distance) {
+  return aggregate == GROUP_MIN ? min(total, distance) : total + distance;
+}
+
+static double groupDistance(const vector<vector<double>> &positions,
+                            GroupAggregate aggregate, double x, double y) {
+  double total = aggregate == GROUP_MIN ?
+    numeric_limits<double>::infinity() : 0.0;
+  for (const auto &position : positions)
+    total = combine(aggregate, total, hypot(x - position[0], y - position[1]));
+  return total;
+}
+
+static double groupLowerBound(const vector<vector<double>> &positions,
+                              GroupAggregate aggregate, const Node::Box &box) {
+  double total = aggregate == GROUP_MIN ?
+    numeric_limits<double>::infinity() : 0.0;
+  for (const auto &position : positions)
+    total = combine(aggregate, total, box.distanceTo(position));
+  return total;
+}
+
+vector<int> KDTree::groupNNTopics(const vector<vector<double>> &positions,
+                                  GroupAggregate aggregate, int k) const {
+  EpochGuard guard;
+  ResultHeap results;
+  if (!positions.empty())
+    groupNNTopics(root, positions, aggregate, k, &results);
+
+  vector<int> topicIds(results.size());
+  for (int index = static_cast<int>(topicIds.size()) - 1; index >= 0;
+       --index) {
+    topicIds[index] = results.top().second;
+    results.pop();
+  }
+  return topicIds;
+}
+
+void KDTree::groupNNTopics(const Node *currentNode,
+                           const vector<vector<double>> &positions,
+                           GroupAggregate aggregate, int k,
+                           ResultHeap *results) const {
+  if (currentNode == nullptr || k <= 0)
+    return;
+  const Node::Box box = currentNode->getBox();
+  if (static_cast<int>(results->size()) >= k &&
+      compareDouble(groupLowerBound(positions, aggregate, box),
+                    results->top().first))
+    return;
+
+  DistanceResult result(groupDistance(positions, aggregate,
+                                      currentNode->topic.getX(),
+                                      currentNode->topic.getY()),
+                        currentNode->topic.getId());
+  if (static_cast<int>(results->size()) < k) {
+    results->push(result);
+  } else if (closerResult(result, results->top())) {
+    results->pop();
+    results->push(result);
+  }
+
+  // Visit the child with the smaller bound first.
+  const Node *firstNode = currentNode->left, *secondNode = currentNode->right;
+  if (firstNode != nullptr && secondNode != nullptr &&
+      groupLowerBound(positions, aggregate, secondNode->getBox()) <
+      groupLowerBound(positions, aggregate, firstNode->getBox()))
+    std::swap(firstNode, secondNode);
+  groupNNTopics(firstNode, positions, aggregate, k, results);
+  groupNNTopics(secondNode, positions, aggregate, k, results);
+}
+
+vector<int> KDTree::groupNNQuestions(const vector<vector<double>> &positions,
+                                     GroupAggregate aggregate, int k) const {
+  EpochGuard guard;
+  QueryArena::Scope scope(&queryArena());
+  GroupQuestions results(k);
+  if (!positions.empty() && k > 0)
+    groupNNQuestions(root, positions, aggregate, ANY_TIME, &results);
+  return results.getQuestionIds();
+}
+
+// A single point under either aggregate is plain distance.
+void KDTree::kNNQuestions(const vector<double> &position,
+                          GroupQuestions *results, double time) const {
+  if (results->getNumResults() <= 0)
+    return;
+  EpochGuard guard;
+  groupNNQuestions(root, {position}, GROUP_MIN, time, results);
+}
+
+void KDTree::groupNNQuestions(const Node *currentNode,
+                              const vector<vector<double>> &positions,
+                              GroupAggregate aggregate, double time,
+                              GroupQuestions *results) const {
+  if (currentNode == nullptr || currentNode->deadAt(time))
+    return;
+  const Node::Box box = currentNode->getBox();
+  if (compareDouble(groupLowerBound(positions, aggregate, box),
+                    results->bound()))
+    return;
+
+  if (currentNode->topic.isLiveAt(time)) {
+    double score = groupDistance(positions, aggregate,
+                                 currentNode->topic.getX(),
+                                 currentNode->topic.getY());
+    for (int questionId : questionIdsOf(currentNode->topic.getId()))
+      results->offer(questionId, score);
+  }
+
+  const Node *firstNode = currentNode->left, *secondNode = currentNode->right;
+  if (firstNode != nullptr && secondNode != nullptr &&
+      groupLowerBound(positions, aggregate, secondNode->getBox()) <
+      groupLowerBound(positions, aggregate, firstNode->getBox()))
+    std::swap(firstNode, secondNode);
+  groupNNQuestions(firstNode, positions, aggregate, time, results);
+  groupNNQuestions(secondNode, positions, aggregate, time, results);
+}
+
+}  // namespace NearbySolver
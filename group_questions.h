@@ -0,0 +1,82 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Best-score question ranking shared by question queries over topic scores.
+ */
+
+#ifndef _GROUP_QUESTIONS_H
+#define _GROUP_QUESTIONS_H
+
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::numeric_limits;
+using std::pair;
+using std::set;
+using std::unordered_map;
+using std::vector;
+
+// Best score of every question seen so far, keeping only the k best; a
+// question scores as its best topic. Both containers live in the query
+// arena of the calling thread.
+class GroupQuestions {
+ public:
+  explicit GroupQuestions(int k) : k(k) {}
+
+  int getNumResults() const { return k; }
+
+  void offer(int questionId, double score) {
+    if (k <= 0)
+      return;
+    auto iter = bestScore.find(questionId);
+    if (iter != bestScore.end()) {
+      if (!closerResult(DistanceResult(score, questionId),
+                        DistanceResult(iter->second, questionId)))
+        return;
+      ranked.erase(DistanceResult(iter->second, questionId));
+      iter->second = score;
+    } else {
+      bestScore[questionId] = score;
+    }
+    ranked.insert(DistanceResult(score, questionId));
+
+    while (static_cast<int>(ranked.size()) > k) {
+      const auto worst = std::prev(ranked.end());
+      bestScore.erase(worst->second);
+      ranked.erase(worst);
+    }
+  }
+
+  // Scores only improve, so the current k-th score bounds the final one.
+  // Nothing is ranked when k <= 0, which leaves no k-th score to bound by.
+  double bound() const {
+    if (ranked.empty() || static_cast<int>(ranked.size()) < k)
+      return numeric_limits<double>::infinity();
+    return std::prev(ranked.end())->first;
+  }
+
+  vector<int> getQuestionIds() const {
+    vector<int> questionIds;
+    for (const auto &result : ranked)
+      questionIds.push_back(result.second);
+    return questionIds;
+  }
+
+ private:
+  int k;
+  unordered_map<int, double, std::hash<int>, std::equal_to<int>,
+                ArenaAllocator<pair<const int, double>>> bestScore;
+  set<DistanceResult, CloserResult, ArenaAllocator<DistanceResult>> ranked;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _GROUP_QUESTIONS_H
@@ -0,0 +1,399 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Input parsing over a ring of buffers filled ahead of the parser.
+ *
+ * Reading the topics through cin costs a system call per few kilobytes and
+ * leaves the disk idle while the parser runs. Here the input is split into
+ * chunks of BUFFER_BYTES, and chunk n is read into buffer n modulo
+ * NUM_BUFFERS. When the parser is done with a buffer it is handed straight
+ * back to the kernel for the chunk NUM_BUFFERS further on, so up to
+ * NUM_BUFFERS - 1 reads stay in flight while one buffer is parsed.
+ *
+ * The ring is driven through the io_uring system calls directly, with one
+ * positional read per chunk. A read that fails or cannot be submitted, say
+ * on a kernel without IORING_OP_READ, drops the ring once the reads in flight
+ * have completed and continues with read() from the start of the next chunk
+ * the parser needs. Only whole buffers are handed back, so a token that
+ * straddles two chunks is copied out before its first buffer is reused.
+ */
+
+#include "./input_reader.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+namespace NearbySolver {
+
+using std::max;
+
+constexpr int InputReader::NUM_BUFFERS;
+constexpr size_t InputReader::BUFFER_BYTES;
+
+namespace {
+
+bool isSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+    c == '\f';
+}
+
+}  // namespace
+
+// Submission and completion queues of an io_uring instance, mapped from
+// the kernel, with the state of the read into each buffer.
+class InputReader::Ring {
+ public:
+  ~Ring();
+  Ring(const Ring&) = delete;
+  Ring& operator= (const Ring&) = delete;
+  // Returns nullptr when the file is not a regular file or io_uring cannot
+  // be set up; otherwise the reads of the first NUM_BUFFERS chunks from the
+  // current file offset are in flight.
+  static unique_ptr<Ring> open(int fd, Buffer *buffers);
+  // Starts reading the chunk into its buffer, which must be free.
+  bool submit(int64_t chunk);
+  // Waits for the read of the chunk and sets its buffer's size.
+  bool wait(int64_t chunk);
+  off_t offsetOf(int64_t chunk) const {
+    return start + static_cast<off_t>(chunk * BUFFER_BYTES);
+  }
+
+ private:
+  static constexpr int FREE = 0;
+  static constexpr int IN_FLIGHT = 1;
+  static constexpr int DONE = 2;
+
+  int ringFd = -1;
+  int fd = -1;
+  off_t start = 0;
+  off_t fileBytes = 0;
+  Buffer *buffers = nullptr;
+  int state[NUM_BUFFERS] = {};
+  int result[NUM_BUFFERS] = {};
+  int inFlight = 0;
+
+  void *ringMemory = MAP_FAILED;
+  size_t ringBytes = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqesBytes = 0;
+  unsigned *sqTail = nullptr;
+  unsigned *sqMask = nullptr;
+  unsigned *sqArray = nullptr;
+  unsigned *cqHead = nullptr;
+  unsigned *cqTail = nullptr;
+  unsigned *cqMask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+
+  Ring() = default;
+  bool reap();
+};
+
+constexpr int InputReader::Ring::FREE;
+constexpr int InputReader::Ring::IN_FLIGHT;
+constexpr int InputReader::Ring::DONE;
+
+unique_ptr<InputReader::Ring> InputReader::Ring::open(int fd,
+                                                      Buffer *buffers) {
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+    return nullptr;
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start < 0)
+    return nullptr;
+
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ringFd = static_cast<int>(syscall(__NR_io_uring_setup, NUM_BUFFERS,
+                                        &params));
+  if (ringFd < 0)
+    return nullptr;
+  // Old kernels map the two queues separately; the single mapping is all
+  // that is supported here.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ::close(ringFd);
+    return nullptr;
+  }
+
+  unique_ptr<Ring> ring(new Ring());
+  ring->ringFd = ringFd;
+  ring->fd = fd;
+  ring->start = start;
+  ring->fileBytes = fileStat.st_size;
+  ring->buffers = buffers;
+  ring->ringBytes = max(
+    params.sq_off.array + params.sq_entries * sizeof(unsigned),
+    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring->ringMemory = mmap(nullptr, ring->ringBytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ringFd,
+                          IORING_OFF_SQ_RING);
+  if (ring->ringMemory == MAP_FAILED)
+    return nullptr;
+  ring->sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+  ring->sqes = static_cast<io_uring_sqe*>(
+    mmap(nullptr, ring->sqesBytes, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+  if (ring->sqes == MAP_FAILED)
+    return nullptr;
+
+  char *memory = static_cast<char*>(ring->ringMemory);
+  ring->sqTail = reinterpret_cast<unsigned*>(memory + params.sq_off.tail);
+  ring->sqMask = reinterpret_cast<unsigned*>(memory + params.sq_off.ring_mask);
+  ring->sqArray = reinterpret_cast<unsigned*>(memory + params.sq_off.array);
+  ring->cqHead = reinterpret_cast<unsigned*>(memory + params.cq_off.head);
+  ring->cqTail = reinterpret_cast<unsigned*>(memory + params.cq_off.tail);
+  ring->cqMask = reinterpret_cast<unsigned*>(memory + params.cq_off.ring_mask);
+  ring->cqes = reinterpret_cast<io_uring_cqe*>(memory + params.cq_off.cqes);
+
+  // A ring that cannot take its first reads is dropped, and its destructor
+  // waits for those already submitted. The reads are positional, so the file
+  // offset is still at the start for read().
+  for (int chunk = 0; chunk < NUM_BUFFERS; ++chunk) {
+    if (!ring->submit(chunk))
+      return nullptr;
+  }
+  return ring;
+}
+
+InputReader::Ring::~Ring() {
+  // The kernel may still be writing into the buffers.
+  while (inFlight > 0 && reap()) {}
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqesBytes);
+  if (ringMemory != MAP_FAILED)
+    munmap(ringMemory, ringBytes);
+  if (ringFd >= 0)
+    ::close(ringFd);
+}
+
+bool InputReader::Ring::submit(int64_t chunk) {
+  int slot = static_cast<int>(chunk % NUM_BUFFERS);
+  off_t offset = offsetOf(chunk);
+  if (offset >= fileBytes) {
+    state[slot] = DONE;
+    result[slot] = 0;
+    return true;
+  }
+
+  unsigned tail = *sqTail;
+  unsigned index = tail & *sqMask;
+  io_uring_sqe &sqe = sqes[index];
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(buffers[slot].data.get());
+  sqe.len = static_cast<uint32_t>(BUFFER_BYTES);
+  sqe.off = static_cast<uint64_t>(offset);
+  sqe.user_data = static_cast<uint64_t>(chunk);
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0) {
+    if (errno != EINTR) {
+      // Take the entry back so that it is never submitted later.
+      __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+      state[slot] = FREE;
+      return false;
+    }
+  }
+  state[slot] = IN_FLIGHT;
+  ++inFlight;
+  return true;
+}
+
+bool InputReader::Ring::reap() {
+  unsigned head = *cqHead;
+  while (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0) < 0 && errno != EINTR)
+      return false;
+  }
+
+  const io_uring_cqe &cqe = cqes[head & *cqMask];
+  int slot = static_cast<int>(cqe.user_data % NUM_BUFFERS);
+  state[slot] = DONE;
+  result[slot] = cqe.res;
+  --inFlight;
+  __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool InputReader::Ring::wait(int64_t chunk) {
+  int slot = static_cast<int>(chunk % NUM_BUFFERS);
+  while (state[slot] == IN_FLIGHT) {
+    if (!reap())
+      return false;
+  }
+  if (state[slot] != DONE || result[slot] < 0)
+    return false;
+  state[slot] = FREE;
+
+  // A short read before the end of the file is finished synchronously, as
+  // the next chunk has been asked for at the full offset already.
+  size_t bytes = result[slot];
+  off_t offset = offsetOf(chunk);
+  while (bytes < BUFFER_BYTES &&
+         offset + static_cast<off_t>(bytes) < fileBytes) {
+    ssize_t numRead = pread(fd, buffers[slot].data.get() + bytes,
+                            BUFFER_BYTES - bytes, offset + bytes);
+    if (numRead < 0 && errno == EINTR)
+      continue;
+    if (numRead <= 0)
+      break;
+    bytes += numRead;
+  }
+  buffers[slot].bytes = bytes;
+  return true;
+}
+
+InputReader::InputReader(int fd) : fd(fd) {
+  for (Buffer &buffer : buffers)
+    buffer.data.reset(new char[BUFFER_BYTES]);
+  ring = Ring::open(fd, buffers);
+}
+
+InputReader::~InputReader() = default;
+
+bool InputReader::fillBuffer(Buffer *buffer) {
+  // One read at a time, so that input typed at a terminal is answered
+  // line by line as it would be through cin.
+  ssize_t numRead;
+  do {
+    numRead = read(fd, buffer->data.get(), BUFFER_BYTES);
+  } while (numRead < 0 && errno == EINTR);
+  buffer->bytes = numRead > 0 ? numRead : 0;
+  return numRead >= 0;
+}
+
+bool InputReader::nextBuffer() {
+  if (atEnd)
+    return false;
+
+  // The buffer just parsed takes the read NUM_BUFFERS chunks ahead. If that
+  // cannot be submitted, the ring is dropped here rather than when the
+  // parser reaches the chunk.
+  bool ringReady = ring != nullptr &&
+    (chunk < 0 || ring->submit(chunk + NUM_BUFFERS));
+  ++chunk;
+  Buffer &buffer = buffers[chunk % NUM_BUFFERS];
+  bool isRead;
+  if (ringReady && ring->wait(chunk)) {
+    isRead = true;
+  } else {
+    if (ring != nullptr) {
+      off_t offset = ring->offsetOf(chunk);
+      ring.reset();
+      if (lseek(fd, offset, SEEK_SET) < 0) {
+        atEnd = true;
+        return false;
+      }
+    }
+    isRead = fillBuffer(&buffer);
+  }
+
+  cursor = buffer.data.get();
+  end = cursor + buffer.bytes;
+  atEnd = !isRead || buffer.bytes == 0;
+  return !atEnd;
+}
+
+bool InputReader::skipSpace() {
+  while (true) {
+    while (cursor != end && isSpace(*cursor))
+      ++cursor;
+    if (cursor != end)
+      return true;
+    if (!nextBuffer())
+      return false;
+  }
+}
+
+bool InputReader::nextToken(const char **tokenBegin, const char **tokenEnd) {
+  if (!skipSpace())
+    return false;
+
+  const char *begin = cursor;
+  while (cursor != end && !isSpace(*cursor))
+    ++cursor;
+  if (cursor != end) {
+    // Followed by a space within the buffer, which stops the conversion.
+    *tokenBegin = begin;
+    *tokenEnd = cursor;
+    return true;
+  }
+
+  token.assign(begin, cursor);
+  while (nextBuffer()) {
+    begin = cursor;
+    while (cursor != end && !isSpace(*cursor))
+      ++cursor;
+    token.append(begin, cursor);
+    if (cursor != end)
+      break;
+  }
+  *tokenBegin = token.c_str();
+  *tokenEnd = token.c_str() + token.size();
+  return true;
+}
+
+InputReader& InputReader::operator>> (int &value) {
+  const char *tokenBegin, *tokenEnd;
+  char *parsedEnd;
+  if (failed || !nextToken(&tokenBegin, &tokenEnd)) {
+    failed = true;
+    return *this;
+  }
+  errno = 0;
+  long parsed = strtol(tokenBegin, &parsedEnd, 10);
+  if (parsedEnd == tokenBegin || errno == ERANGE || parsed < INT_MIN ||
+      parsed > INT_MAX)
+    failed = true;
+  else
+    value = static_cast<int>(parsed);
+  return *this;
+}
+
+InputReader& InputReader::operator>> (double &value) {
+  const char *tokenBegin, *tokenEnd;
+  char *parsedEnd;
+  if (failed || !nextToken(&tokenBegin, &tokenEnd)) {
+    failed = true;
+    return *this;
+  }
+  double parsed = strtod(tokenBegin, &parsedEnd);
+  if (parsedEnd == tokenBegin)
+    failed = true;
+  else
+    value = parsed;
+  return *this;
+}
+
+bool InputReader::atLineEnd() {
+  while (true) {
+    while (cursor != end && *cursor != '\n' && isSpace(*cursor))
+      ++cursor;
+    if (cursor != end)
+      return *cursor == '\n';
+    if (!nextBuffer())
+      return true;
+  }
+}
+
+InputReader& InputReader::operator>> (char &value) {
+  if (failed || !skipSpace()) {
+    failed = true;
+    return *this;
+  }
+  value = *cursor++;
+  return *this;
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Input parsing over a ring of buffers filled ahead of the parser.
+ */
+
+#ifndef _INPUT_READER_H
+#define _INPUT_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace NearbySolver {
+
+using std::size_t;
+using std::string;
+using std::unique_ptr;
+
+class InputReader;
+
+// Reads a file descriptor front to back and parses whitespace separated
+// numbers and characters from it the way an istream would. On a regular
+// file every buffer of the ring has a read in flight through io_uring, so
+// the parser works through one buffer while the kernel fills the next ones.
+// Pipes, terminals and kernels without io_uring are read with a plain
+// read() loop into the same buffers.
+class InputReader {
+ public:
+  static constexpr int NUM_BUFFERS = 8;
+  static constexpr size_t BUFFER_BYTES = 1 << 20;
+
+  explicit InputReader(int fd);
+  ~InputReader();
+  InputReader(const InputReader&) = delete;
+  InputReader& operator= (const InputReader&) = delete;
+  InputReader& operator>> (int &value);
+  InputReader& operator>> (double &value);
+  InputReader& operator>> (char &value);
+  // Skips blanks up to the end of the current line, returning true if
+  // nothing else is left on it.
+  bool atLineEnd();
+  // False once a read failed or ran past the end of the input, as for a
+  // stream; the value asked for is then left unchanged.
+  explicit operator bool() const { return !failed; }
+  bool usesRing() const { return ring != nullptr; }
+
+ private:
+  class Ring;
+
+  // Chunk number n of the input is read into buffer n modulo NUM_BUFFERS.
+  class Buffer {
+   public:
+    unique_ptr<char[]> data;
+    size_t bytes = 0;
+  };
+
+  int fd;
+  // Declared after the buffers so that it is destroyed, and waits for the
+  // reads in flight, before they are freed.
+  Buffer buffers[NUM_BUFFERS];
+  unique_ptr<Ring> ring;
+  // Chunk held by the buffer being parsed.
+  int64_t chunk = -1;
+  const char *cursor = nullptr;
+  const char *end = nullptr;
+  bool atEnd = false;
+  bool failed = false;
+  string token;
+
+  bool nextBuffer();
+  bool fillBuffer(Buffer *buffer);
+  bool skipSpace();
+  bool nextToken(const char **tokenBegin, const char **tokenEnd);
+};
+
+}  // namespace NearbySolver
+
+#endif  // _INPUT_READER_H
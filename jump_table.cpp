@@ -0,0 +1,154 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Grid directory into the KD-Tree for starting searches below the root.
+ *
+ * Each cell is pushed down from the root for as long as it lies entirely on
+ * one side of the split, so its node is the deepest one whose region covers
+ * it. A search starts at that node; if the ball around the query point out
+ * to the k-th result stays inside the node's region, nothing outside can
+ * compete and the upper levels are never touched. Otherwise the search falls
+ * back to the root with the results found so far as its bound, skipping the
+ * subtree it already searched.
+ *
+ * Inserts only add leaves, which leaves every region intact, so the table
+ * stays valid across them. Removing a topic can move a split or free a
+ * node, so the table is dropped and built again afterwards; that is
+ * GRID_SIZE squared descents, about as many node steps as a few searches.
+ */
+
+#include "./jump_table.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "./epoch.h"
+#include "./probes.h"
+
+namespace NearbySolver {
+
+using std::numeric_limits;
+using std::vector;
+
+constexpr int JumpTable::GRID_SIZE;
+
+bool JumpTable::Cell::holdsBall(const vector<double> &position,
+                                double distance) const {
+  // Results within EPSILON of the k-th one may still displace it on id.
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    if (position[dimension] - minCorner[dimension] <= distance + EPSILON ||
+        maxCorner[dimension] - position[dimension] <= distance + EPSILON)
+      return false;
+  }
+  return true;
+}
+
+void JumpTable::build(const Node *root) {
+  cells.assign(GRID_SIZE * GRID_SIZE, Cell());
+  if (root == nullptr)
+    return;
+
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    minCorner[dimension] = root->getMinCoordinate(dimension);
+    double extent = root->getMaxCoordinate(dimension) - minCorner[dimension];
+    cellSize[dimension] = extent > 0.0 ? extent / GRID_SIZE : 1.0;
+  }
+
+  for (int row = 0; row < GRID_SIZE; ++row) {
+    for (int column = 0; column < GRID_SIZE; ++column) {
+      double cellMin[2] = {minCorner[0] + column * cellSize[0],
+                           minCorner[1] + row * cellSize[1]};
+      double cellMax[2] = {cellMin[0] + cellSize[0], cellMin[1] + cellSize[1]};
+      Cell &cell = cells[row * GRID_SIZE + column];
+      for (int dimension = 0; dimension < 2; ++dimension) {
+        cell.minCorner[dimension] = -numeric_limits<double>::infinity();
+        cell.maxCorner[dimension] = numeric_limits<double>::infinity();
+      }
+
+      const Node *currentNode = root;
+      int depth = 0;
+      while (true) {
+        int depthParity = depth & 1;
+        double split = currentNode->topic.coordinateAt(depthParity);
+        const Node *nextNode = nullptr;
+        if (cellMax[depthParity] < split) {
+          nextNode = currentNode->left;
+          if (nextNode != nullptr)
+            cell.maxCorner[depthParity] = split;
+        } else if (cellMin[depthParity] >= split) {
+          nextNode = currentNode->right;
+          if (nextNode != nullptr)
+            cell.minCorner[depthParity] = split;
+        }
+        if (nextNode == nullptr)
+          break;
+        currentNode = nextNode;
+        ++depth;
+      }
+      cell.node = currentNode;
+      cell.depth = depth;
+    }
+  }
+}
+
+const JumpTable::Cell* JumpTable::find(const vector<double> &position) const {
+  if (cells.empty())
+    return nullptr;
+
+  int index[2];
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    double offset = (position[dimension] - minCorner[dimension]) /
+      cellSize[dimension];
+    if (!(offset >= 0.0) || offset > GRID_SIZE)
+      return nullptr;
+    index[dimension] = std::min(static_cast<int>(offset), GRID_SIZE - 1);
+  }
+  return &cells[index[1] * GRID_SIZE + index[0]];
+}
+
+void KDTree::buildJumpTable() {
+  NEARBY_PROBE1(jump__table__start, size());
+  JumpTable *table = new JumpTable();
+  table->build(root);
+  const JumpTable *oldTable = jumpTable.exchange(table);
+  if (oldTable != nullptr)
+    epochs.retire([oldTable]() { delete oldTable; });
+  NEARBY_PROBE1(jump__table__end, size());
+}
+
+void KDTree::remove(const Topic &topic) {
+  bool hadJumpTable = jumpTable.load() != nullptr;
+  dropJumpTable();
+  root.store(remove(root.load(std::memory_order_relaxed), false, topic),
+             std::memory_order_release);
+  if (hadJumpTable)
+    buildJumpTable();
+}
+
+void KDTree::dropJumpTable() {
+  const JumpTable *oldTable = jumpTable.exchange(nullptr);
+  if (oldTable != nullptr)
+    epochs.retire([oldTable]() { delete oldTable; });
+}
+
+void KDTree::kNNTopics(const vector<double> &position, int k,
+                       ResultHeap *results, double time) const {
+  EpochGuard guard;
+  const JumpTable *table = jumpTable;
+  const JumpTable::Cell *cell =
+    table == nullptr ? nullptr : table->find(position);
+  if (cell == nullptr) {
+    kNNTopics(root, false, position, k, time, results);
+    return;
+  }
+
+  const Node *startNode = cell->node;
+  kNNTopics(startNode, cell->depth, position, k, time, results);
+  if (static_cast<int>(results->size()) >= k &&
+      (k <= 0 || cell->holdsBall(position, results->top().first)))
+    return;
+  kNNTopics(root, false, position, k, time, results, startNode);
+}
+
+}  // namespace NearbySolver
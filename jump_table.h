@@ -0,0 +1,54 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Grid directory into the KD-Tree for starting searches below the root.
+ */
+
+#ifndef _JUMP_TABLE_H
+#define _JUMP_TABLE_H
+
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::vector;
+
+class JumpTable;
+
+// Uniform grid over the bounding box of the tree that maps each cell to the
+// deepest node whose region, the part of the plane its split planes leave
+// to it, covers the whole cell. A query point inside a cell can start its
+// search at that node instead of descending the upper levels, and only has
+// to look outside when its k-th result reaches past the node's region.
+class JumpTable {
+ public:
+  static constexpr int GRID_SIZE = 32;
+
+  class Cell {
+   public:
+    const Node *node = nullptr;
+    int depth = 0;
+    // Region of the node; unbounded sides are infinite.
+    double minCorner[2];
+    double maxCorner[2];
+
+    // Whether every point outside the region is farther than distance.
+    bool holdsBall(const vector<double> &position, double distance) const;
+  };
+
+  JumpTable() = default;
+  ~JumpTable() = default;
+  void build(const Node *root);
+  // Cell containing the position, or nullptr outside the grid.
+  const Cell* find(const vector<double> &position) const;
+
+ private:
+  double minCorner[2] = {0.0, 0.0};
+  double cellSize[2] = {1.0, 1.0};
+  vector<Cell> cells;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _JUMP_TABLE_H
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * All-topics k-NN self-join for the related nearby topics table.
+ *
+ * Calling kNNTopics once per topic repeats the same descent from the root for
+ * topics that are next to each other. Instead, the topics are packed into
+ * buckets and each bucket is joined against the tree as a unit: a subtree is
+ * skipped when the distance between its box and the bucket's box is larger
+ * than the worst k-th distance of any topic in the bucket. Buckets are
+ * independent, so worker threads pull them from a shared counter.
+ */
+
+#include "./knn_join.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "./balanced_build.h"
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::max;
+using std::numeric_limits;
+using std::thread;
+using std::vector;
+
+constexpr int KNNJoin::MAGIC;
+constexpr int KNNJoin::BUCKET_SIZE;
+
+void KNNJoin::compute(const unordered_map<int, Topic> &allTopics, int k) {
+  numNeighbors = max(k, 0);
+  points.clear();
+  buckets.clear();
+  leaves.clear();
+  related.clear();
+  if (numNeighbors == 0) {
+    for (const auto &entry : allTopics)
+      related[entry.first];
+    return;
+  }
+  for (const auto &entry : allTopics) {
+    Point point;
+    point.coordinates[0] = entry.second.getX();
+    point.coordinates[1] = entry.second.getY();
+    point.id = entry.second.getId();
+    points.push_back(point);
+  }
+  if (points.empty())
+    return;
+  build(0, static_cast<int>(points.size()));
+
+  vector<vector<int>> neighbors(points.size());
+  atomic<int> nextLeaf(0);
+  int numThreads = max(1u, thread::hardware_concurrency());
+  vector<thread> workers;
+  for (int threadIndex = 0; threadIndex < numThreads; ++threadIndex) {
+    workers.emplace_back([&]() {
+      for (int i = nextLeaf++; i < static_cast<int>(leaves.size());
+           i = nextLeaf++) {
+        const Bucket &leaf = buckets[leaves[i]];
+        vector<ResultHeap> results(leaf.end - leaf.begin);
+        double bound = numeric_limits<double>::infinity();
+        join(leaves[i], 0, &results, &bound);
+
+        for (int j = leaf.begin; j < leaf.end; ++j) {
+          ResultHeap &heap = results[j - leaf.begin];
+          vector<int> &topicIds = neighbors[j];
+          topicIds.resize(heap.size());
+          for (int position = static_cast<int>(heap.size()) - 1;
+               position >= 0; --position) {
+            topicIds[position] = heap.top().second;
+            heap.pop();
+          }
+        }
+      }
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+
+  for (size_t i = 0; i < points.size(); ++i)
+    related[points[i].id] = std::move(neighbors[i]);
+}
+
+int KNNJoin::build(int begin, int end) {
+  int index = static_cast<int>(buckets.size());
+  buckets.emplace_back();
+  Bucket bucket;
+  bucket.begin = begin;
+  bucket.end = end;
+  bucket.box = Node::Box::empty();
+  for (int i = begin; i < end; ++i)
+    bucket.box.extend(points[i].coordinates[0], points[i].coordinates[1]);
+
+  if (end - begin <= BUCKET_SIZE) {
+    leaves.push_back(index);
+  } else {
+    // Split the wider side at the median.
+    int dimension = (bucket.box.maxCorner[0] - bucket.box.minCorner[0] <
+                     bucket.box.maxCorner[1] - bucket.box.minCorner[1]);
+    int middle = static_cast<int>(
+      splitAtMedian(points.begin() + begin, points.begin() + end, dimension,
+                    [](const Point &point, int axis) {
+                      return point.coordinates[axis];
+                    }) - points.begin());
+    bucket.left = build(begin, middle);
+    bucket.right = build(middle, end);
+  }
+  buckets[index] = bucket;
+  return index;
+}
+
+void KNNJoin::join(int leaf, int bucket, vector<ResultHeap> *results,
+                   double *bound) const {
+  const Bucket &queryBucket = buckets[leaf];
+  const Bucket &currentBucket = buckets[bucket];
+
+  if (compareDouble(queryBucket.box.distanceTo(currentBucket.box), *bound))
+    return;
+
+  if (!currentBucket.isLeaf()) {
+    // Visit the nearer child first so the bound tightens early.
+    int firstBucket = currentBucket.left, secondBucket = currentBucket.right;
+    if (queryBucket.box.distanceTo(buckets[secondBucket].box) <
+        queryBucket.box.distanceTo(buckets[firstBucket].box))
+      std::swap(firstBucket, secondBucket);
+    join(leaf, firstBucket, results, bound);
+    join(leaf, secondBucket, results, bound);
+    return;
+  }
+
+  double worst = 0.0;
+  for (int i = queryBucket.begin; i < queryBucket.end; ++i) {
+    ResultHeap &heap = (*results)[i - queryBucket.begin];
+    const Point &queryPoint = points[i];
+    for (int j = currentBucket.begin; j < currentBucket.end; ++j) {
+      if (points[j].id == queryPoint.id)
+        continue;
+      DistanceResult result(
+          hypot(points[j].coordinates[0] - queryPoint.coordinates[0],
+                points[j].coordinates[1] - queryPoint.coordinates[1]),
+          points[j].id);
+      if (static_cast<int>(heap.size()) < numNeighbors) {
+        heap.push(result);
+      } else if (closerResult(result, heap.top())) {
+        heap.pop();
+        heap.push(result);
+      }
+    }
+    worst = max(worst, static_cast<int>(heap.size()) < numNeighbors ?
+                numeric_limits<double>::infinity() : heap.top().first);
+  }
+  *bound = worst;
+}
+
+void KNNJoin::write(ostream &out) const {
+  vector<int> topicIds;
+  for (const auto &entry : related)
+    topicIds.push_back(entry.first);
+  std::sort(topicIds.begin(), topicIds.end());
+
+  auto writeInt = [&out](int value) {
+    uint32_t bits = static_cast<uint32_t>(value);
+    char bytes[4];
+    for (int i = 0; i < 4; ++i)
+      bytes[i] = static_cast<char>(bits >> (8 * i));
+    out.write(bytes, sizeof(bytes));
+  };
+  writeInt(MAGIC);
+  writeInt(static_cast<int>(topicIds.size()));
+  writeInt(numNeighbors);
+  for (int topicId : topicIds) {
+    const vector<int> &neighbors = related.at(topicId);
+    writeInt(topicId);
+    writeInt(static_cast<int>(neighbors.size()));
+    for (int neighborId : neighbors)
+      writeInt(neighborId);
+  }
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * All-topics k-NN self-join for the related nearby topics table.
+ */
+
+#ifndef _KNN_JOIN_H
+#define _KNN_JOIN_H
+
+#include <ostream>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::ostream;
+using std::vector;
+
+class KNNJoin;
+
+// Computes the k nearest other topics of every topic at once. Topics are
+// packed into leaf buckets of a static KD-Tree, and all topics of a bucket
+// walk the tree together, pruning with the bucket's bounding box and the
+// worst k-th distance among them.
+class KNNJoin {
+ public:
+  KNNJoin() = default;
+  ~KNNJoin() = default;
+  // With k <= 0 every topic gets an empty list.
+  void compute(const unordered_map<int, Topic> &allTopics, int k);
+  // Writes the table as little-endian 32-bit integers, whatever the byte
+  // order of the machine: magic, topic count and k, then per topic in
+  // ascending id order its id, neighbor count and neighbor ids from nearest
+  // to furthest.
+  void write(ostream &out) const;
+  const vector<int>& getRelatedTopics(int topicId) const {
+    return related.at(topicId);
+  }
+
+  static constexpr int MAGIC = 0x4e4a4e4b;  // "KNJN"
+  static constexpr int BUCKET_SIZE = 32;
+
+ private:
+  class Point {
+   public:
+    double coordinates[2];
+    int id = 0;
+  };
+
+  class Bucket {
+   public:
+    int begin = 0;
+    int end = 0;
+    int left = -1;
+    int right = -1;
+    Node::Box box;
+    bool isLeaf() const { return left < 0; }
+  };
+
+  int numNeighbors = 0;
+  vector<Point> points;
+  vector<Bucket> buckets;
+  vector<int> leaves;
+  unordered_map<int, vector<int>> related;
+
+  int build(int begin, int end);
+  void join(int leaf, int bucket, vector<ResultHeap> *results,
+            double *bound) const;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _KNN_JOIN_H
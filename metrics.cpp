@@ -0,0 +1,326 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Query and index metrics exported in the Prometheus text format.
+ *
+ * A thread finds its counter block through a thread_local pointer, which it
+ * registers under the registry mutex the first time it records anything.
+ * From then on recording a query is a handful of relaxed loads and stores
+ * to memory no other thread writes, so queries on different threads never
+ * contend; a scrape takes the mutex, so that no block is retired under it,
+ * and reads every block. The counts it sums may be a few queries apart from
+ * each other, which the text format tolerates.
+ *
+ * Heap figures come from mallinfo2 and cover the whole process; the query
+ * arenas are reported separately from the capacity each thread last kept.
+ */
+
+#include "./metrics.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#include "./disk_index.h"
+#include "./query_arena.h"
+
+namespace NearbySolver {
+
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::unique_lock;
+
+constexpr int Metrics::NUM_LATENCY_BUCKETS;
+constexpr int Metrics::NUM_VISIT_BUCKETS;
+
+thread_local uint64_t nodeVisits = 0;
+Metrics metrics;
+
+namespace {
+
+const char *const QUERY_TYPE_NAMES[Metrics::NUM_QUERY_TYPES] = {
+  "t", "q", "T", "Q"
+};
+
+// Single writer increment, see the top of the file.
+void bump(atomic<uint64_t> *counter, uint64_t amount) {
+  counter->store(counter->load(memory_order_relaxed) + amount,
+                 memory_order_relaxed);
+}
+
+// Smallest power of two bucket, counted from 1, that holds the value; the
+// last bucket also takes everything larger.
+int bucketOf(double value, int numBuckets) {
+  int bucket = 0;
+  double upper = 1.0;
+  while (bucket < numBuckets - 1 && value > upper) {
+    upper *= 2.0;
+    ++bucket;
+  }
+  return bucket;
+}
+
+// Label values are quoted, so quotes, backslashes and line breaks in them
+// are escaped.
+string escapeLabel(const string &value) {
+  string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+void writeHeader(ostream &out, const char *name, const char *type,
+                 const char *help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+// Cumulative buckets of a power of two histogram whose first upper bound
+// is scale, with its sum and count.
+void writeHistogram(ostream &out, const char *name, const char *typeName,
+                    const atomic<uint64_t> *buckets, int numBuckets,
+                    double scale, double sum) {
+  uint64_t cumulative = 0;
+  double upper = scale;
+  for (int bucket = 0; bucket < numBuckets; ++bucket) {
+    cumulative += buckets[bucket].load(memory_order_relaxed);
+    out << name << "_bucket{type=\"" << typeName << "\",le=\"";
+    if (bucket == numBuckets - 1)
+      out << "+Inf";
+    else
+      out << upper;
+    out << "\"} " << cumulative << "\n";
+    upper *= 2.0;
+  }
+  out << name << "_sum{type=\"" << typeName << "\"} " << sum << "\n";
+  out << name << "_count{type=\"" << typeName << "\"} " << cumulative << "\n";
+}
+
+}  // namespace
+
+Metrics::ThreadBlock::ThreadBlock() {
+  for (int type = 0; type < NUM_QUERY_TYPES; ++type) {
+    queries[type] = 0;
+    latencyNanos[type] = 0;
+    visits[type] = 0;
+    for (auto &bucket : latencyBuckets[type])
+      bucket = 0;
+    for (auto &bucket : visitBuckets[type])
+      bucket = 0;
+  }
+  updates = 0;
+  arenaBytes = 0;
+}
+
+void Metrics::ThreadBlock::addTo(ThreadBlock *total) const {
+  for (int type = 0; type < NUM_QUERY_TYPES; ++type) {
+    bump(&total->queries[type], queries[type].load(memory_order_relaxed));
+    bump(&total->latencyNanos[type],
+         latencyNanos[type].load(memory_order_relaxed));
+    bump(&total->visits[type], visits[type].load(memory_order_relaxed));
+    for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; ++bucket)
+      bump(&total->latencyBuckets[type][bucket],
+           latencyBuckets[type][bucket].load(memory_order_relaxed));
+    for (int bucket = 0; bucket < NUM_VISIT_BUCKETS; ++bucket)
+      bump(&total->visitBuckets[type][bucket],
+           visitBuckets[type][bucket].load(memory_order_relaxed));
+  }
+  bump(&total->updates, updates.load(memory_order_relaxed));
+  bump(&total->arenaBytes, arenaBytes.load(memory_order_relaxed));
+}
+
+Metrics::ThreadSlot::~ThreadSlot() {
+  metrics->retire(block);
+}
+
+Metrics::ThreadBlock* Metrics::localBlock() {
+  thread_local unique_ptr<ThreadSlot> slot;
+  if (slot == nullptr) {
+    lock_guard<mutex> lock(registryMutex);
+    blocks.emplace_back(new ThreadBlock());
+    slot.reset(new ThreadSlot(this, blocks.back().get()));
+  }
+  return slot->block;
+}
+
+void Metrics::retire(ThreadBlock *block) {
+  lock_guard<mutex> lock(registryMutex);
+  // An exited thread's arena is gone with it.
+  block->arenaBytes = 0;
+  block->addTo(&retired);
+  for (auto iter = blocks.begin(); iter != blocks.end(); ++iter) {
+    if (iter->get() == block) {
+      blocks.erase(iter);
+      break;
+    }
+  }
+}
+
+void Metrics::recordQuery(QueryType type, double seconds, uint64_t visits) {
+  ThreadBlock *block = localBlock();
+  bump(&block->queries[type], 1);
+  bump(&block->latencyNanos[type], static_cast<uint64_t>(seconds * 1e9));
+  bump(&block->latencyBuckets[type][bucketOf(seconds * 1e6,
+                                             NUM_LATENCY_BUCKETS)], 1);
+  bump(&block->visits[type], visits);
+  bump(&block->visitBuckets[type][bucketOf(static_cast<double>(visits),
+                                           NUM_VISIT_BUCKETS)], 1);
+  block->arenaBytes.store(queryArena().capacity(), memory_order_relaxed);
+}
+
+void Metrics::recordUpdate() {
+  bump(&localBlock()->updates, 1);
+}
+
+void Metrics::recordBuild(double seconds) {
+  buildSeconds.store(seconds, memory_order_relaxed);
+}
+
+void Metrics::setIndexSize(int topicCount, int questionCount) {
+  numTopics.store(topicCount, memory_order_relaxed);
+  numQuestions.store(questionCount, memory_order_relaxed);
+}
+
+void Metrics::watchBufferPool(const string &name, const BufferPool *pool) {
+  lock_guard<mutex> lock(registryMutex);
+  bufferPools.emplace_back(name, pool);
+}
+
+void Metrics::unwatchBufferPool(const BufferPool *pool) {
+  lock_guard<mutex> lock(registryMutex);
+  bufferPools.erase(
+    std::remove_if(bufferPools.begin(), bufferPools.end(),
+                   [pool](const pair<string, const BufferPool*> &entry) {
+                     return entry.second == pool;
+                   }),
+    bufferPools.end());
+}
+
+void Metrics::write(ostream &out) const {
+  ThreadBlock total;
+  vector<pair<string, pair<int64_t, int64_t>>> poolCounts;
+  {
+    lock_guard<mutex> lock(registryMutex);
+    retired.addTo(&total);
+    for (const auto &block : blocks)
+      block->addTo(&total);
+    for (const auto &entry : bufferPools) {
+      poolCounts.emplace_back(entry.first,
+                              std::make_pair(entry.second->getHits(),
+                                             entry.second->getMisses()));
+    }
+  }
+
+  // Enough digits for the bucket bounds to print exactly.
+  std::streamsize oldPrecision = out.precision(12);
+  writeHeader(out, "nearby_queries_total", "counter",
+              "Queries answered, by type.");
+  for (int type = 0; type < NUM_QUERY_TYPES; ++type) {
+    out << "nearby_queries_total{type=\"" << QUERY_TYPE_NAMES[type] << "\"} "
+        << total.queries[type] << "\n";
+  }
+  writeHeader(out, "nearby_query_latency_seconds", "histogram",
+              "Time to answer a query, by type.");
+  for (int type = 0; type < NUM_QUERY_TYPES; ++type) {
+    writeHistogram(out, "nearby_query_latency_seconds",
+                   QUERY_TYPE_NAMES[type], total.latencyBuckets[type],
+                   NUM_LATENCY_BUCKETS, 1e-6, total.latencyNanos[type] * 1e-9);
+  }
+  writeHeader(out, "nearby_query_nodes_visited", "histogram",
+              "KD-Tree nodes visited per query, by type.");
+  for (int type = 0; type < NUM_QUERY_TYPES; ++type) {
+    writeHistogram(out, "nearby_query_nodes_visited", QUERY_TYPE_NAMES[type],
+                   total.visitBuckets[type], NUM_VISIT_BUCKETS, 1.0,
+                   static_cast<double>(total.visits[type]));
+  }
+
+  writeHeader(out, "nearby_buffer_pool_hits_total", "counter",
+              "Disk index blocks found in the buffer pool.");
+  for (const auto &entry : poolCounts) {
+    out << "nearby_buffer_pool_hits_total{pool=\""
+        << escapeLabel(entry.first) << "\"} "
+        << entry.second.first << "\n";
+  }
+  writeHeader(out, "nearby_buffer_pool_misses_total", "counter",
+              "Disk index blocks read into the buffer pool.");
+  for (const auto &entry : poolCounts) {
+    out << "nearby_buffer_pool_misses_total{pool=\""
+        << escapeLabel(entry.first) << "\"} "
+        << entry.second.second << "\n";
+  }
+
+  writeHeader(out, "nearby_index_topics", "gauge", "Topics in the index.");
+  out << "nearby_index_topics " << numTopics.load() << "\n";
+  writeHeader(out, "nearby_index_questions", "gauge",
+              "Questions in the index.");
+  out << "nearby_index_questions " << numQuestions.load() << "\n";
+  writeHeader(out, "nearby_index_version", "counter",
+              "Updates applied to the index since it was built.");
+  out << "nearby_index_version " << total.updates << "\n";
+  writeHeader(out, "nearby_index_build_seconds", "gauge",
+              "Time taken to load and build the index last.");
+  out << "nearby_index_build_seconds " << buildSeconds.load() << "\n";
+
+  struct mallinfo2 heap = mallinfo2();
+  writeHeader(out, "nearby_heap_allocated_bytes", "gauge",
+              "Bytes of heap in use, from mallinfo2.");
+  out << "nearby_heap_allocated_bytes " << heap.uordblks + heap.hblkhd << "\n";
+  writeHeader(out, "nearby_heap_free_bytes", "gauge",
+              "Bytes held by the heap but free, from mallinfo2.");
+  out << "nearby_heap_free_bytes " << heap.fordblks << "\n";
+  writeHeader(out, "nearby_query_arena_bytes", "gauge",
+              "Bytes kept by the query arenas of live threads.");
+  out << "nearby_query_arena_bytes " << total.arenaBytes << "\n";
+  out.precision(oldPrecision);
+}
+
+bool MetricsExporter::start(const string &path, double intervalSeconds) {
+  if (writer.joinable() || intervalSeconds <= 0.0)
+    return false;
+
+  this->path = path;
+  this->intervalSeconds = intervalSeconds;
+  stopping = false;
+  writer = thread([this]() {
+    auto interval = std::chrono::duration<double>(this->intervalSeconds);
+    unique_lock<mutex> lock(stopMutex);
+    while (!stopped.wait_for(lock, interval, [this]() { return stopping; }))
+      writeNow();
+  });
+  return true;
+}
+
+void MetricsExporter::stop() {
+  if (!writer.joinable())
+    return;
+
+  {
+    lock_guard<mutex> lock(stopMutex);
+    stopping = true;
+  }
+  stopped.notify_all();
+  writer.join();
+  writeNow();
+}
+
+bool MetricsExporter::writeNow() const {
+  string temporaryPath = path + ".tmp";
+  {
+    std::ofstream out(temporaryPath);
+    metrics.write(out);
+    if (!out.flush())
+      return false;
+  }
+  return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Query and index metrics exported in the Prometheus text format.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::condition_variable;
+using std::mutex;
+using std::ostream;
+using std::pair;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+class BufferPool;
+class Metrics;
+class MetricsExporter;
+
+// Nodes visited by the searches of the calling thread, counted without any
+// atomic so that the traversals can bump it per node.
+extern thread_local uint64_t nodeVisits;
+
+// Counters of the queries and updates made by every thread. Each thread
+// writes only to its own block, with plain loads and stores of its atomics,
+// and a scrape adds the blocks up; blocks of threads that have exited are
+// folded into one retired block. Index sizes, build time and watched buffer
+// pools are gauges set outside the query path.
+class Metrics {
+ public:
+  enum QueryType {
+    TOPIC_QUERY,
+    QUESTION_QUERY,
+    TIMED_TOPIC_QUERY,
+    TIMED_QUESTION_QUERY,
+    NUM_QUERY_TYPES
+  };
+
+  // Histogram buckets are powers of two, from 1 microsecond and from 1 node.
+  static constexpr int NUM_LATENCY_BUCKETS = 25;
+  static constexpr int NUM_VISIT_BUCKETS = 25;
+
+  Metrics() = default;
+  ~Metrics() = default;
+  Metrics(const Metrics&) = delete;
+  Metrics& operator= (const Metrics&) = delete;
+
+  void recordQuery(QueryType type, double seconds, uint64_t visits);
+  // An update to the index; the version exported is the number of updates.
+  void recordUpdate();
+  void recordBuild(double seconds);
+  void setIndexSize(int numTopics, int numQuestions);
+  // Buffer pools whose hits and misses are exported under the name until
+  // they are unwatched, which must happen before they are destroyed.
+  void watchBufferPool(const string &name, const BufferPool *pool);
+  void unwatchBufferPool(const BufferPool *pool);
+  void write(ostream &out) const;
+
+ private:
+  class ThreadBlock {
+   public:
+    atomic<uint64_t> queries[NUM_QUERY_TYPES];
+    atomic<uint64_t> latencyBuckets[NUM_QUERY_TYPES][NUM_LATENCY_BUCKETS];
+    atomic<uint64_t> latencyNanos[NUM_QUERY_TYPES];
+    atomic<uint64_t> visitBuckets[NUM_QUERY_TYPES][NUM_VISIT_BUCKETS];
+    atomic<uint64_t> visits[NUM_QUERY_TYPES];
+    atomic<uint64_t> updates;
+    atomic<uint64_t> arenaBytes;
+
+    ThreadBlock();
+    void addTo(ThreadBlock *total) const;
+  };
+
+  // Owned by a thread_local slot that retires the block when its thread
+  // exits.
+  class ThreadSlot {
+   public:
+    ThreadSlot(Metrics *metrics, ThreadBlock *block) :
+      metrics(metrics), block(block) {}
+    ~ThreadSlot();
+    Metrics *metrics;
+    ThreadBlock *block;
+  };
+
+  mutable mutex registryMutex;
+  vector<unique_ptr<ThreadBlock>> blocks;
+  ThreadBlock retired;
+  vector<pair<string, const BufferPool*>> bufferPools;
+  atomic<double> buildSeconds{0.0};
+  atomic<int> numTopics{0};
+  atomic<int> numQuestions{0};
+
+  ThreadBlock* localBlock();
+  void retire(ThreadBlock *block);
+};
+
+// Rewrites a file with the metrics on a background thread at a fixed
+// interval, and once more when stopped. The text goes to a temporary file
+// that is renamed over the target, so that a reader such as the node
+// exporter's textfile collector never sees half of it.
+class MetricsExporter {
+ public:
+  MetricsExporter() = default;
+  ~MetricsExporter() { stop(); }
+  MetricsExporter(const MetricsExporter&) = delete;
+  MetricsExporter& operator= (const MetricsExporter&) = delete;
+  bool start(const string &path, double intervalSeconds);
+  void stop();
+  bool writeNow() const;
+
+ private:
+  string path;
+  double intervalSeconds = 0.0;
+  thread writer;
+  mutex stopMutex;
+  condition_variable stopped;
+  bool stopping = false;
+};
+
+extern Metrics metrics;
+
+}  // namespace NearbySolver
+
+#endif  // _METRICS_H
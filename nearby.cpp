@@ -11,8 +11,21 @@
  */
 
 #include "./nearby.h"
-
+#include "./input_reader.h"
+#include "./jump_table.h"
+#include "./metrics.h"
+#include "./probes.h"
+#include "./question_adjacency.h"
+#include "./slow_query_log.h"
+#include "./subscriptions.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <set>
 #include <unordered_map>
@@ -20,27 +33,52 @@
 
 namespace NearbySolver {
 
-using std::cin;
+using std::atomic;
 using std::cout;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::chrono::duration;
+using std::chrono::steady_clock;
 using std::set;
 using std::unordered_map;
 using std::vector;
 
 int numResults;
 vector<double> queryPosition = {0.0, 0.0};
+double queryTime = ANY_TIME;
 
-set<Topic> topicSet;
-set<Question> questionSet;
+TopicSet topicSet;
+QuestionSet questionSet;
 
 unordered_map<int, Topic> topics;
 unordered_map<int, Question> questions;
 
 // Mapping from question id to topic id associated with it of topic
 // closest to the query coordinate.
-unordered_map<int, int> closestQuestionTopic;
+ClosestTopicMap closestQuestionTopic;
+// Questions present in closestQuestionTopic, tested before probing it.
+QuestionBitmap visitedQuestions;
+int maxQuestionId = -1;
 
 KDTree kdtree;
 
+namespace {
+
+// Set by SIGUSR1 and acted on between queries.
+volatile std::sig_atomic_t slowQueryDumpRequested = 0;
+
+void requestSlowQueryDump(int) {
+  slowQueryDumpRequested = 1;
+}
+
+// Distance and id of the closest topic of every question in
+// visitedQuestions, indexed by question id once solve has sized it, so that
+// a question reached again is compared without a hash probe; the entries
+// of other questions are stale. Ids past the end use closestQuestionTopic.
+vector<DistanceResult> closestTopicOf;
+
+}  // namespace
+
 void KDTree::freeNodes(Node *currentNode) {
   if (currentNode == nullptr)
     return;
@@ -51,6 +89,7 @@ void KDTree::freeNodes(Node *currentNode) {
 }
 
 KDTree::~KDTree() {
+  delete jumpTable.load();
   freeNodes(root);
 }
 
@@ -58,26 +97,132 @@ Node* KDTree::insert(Node *currentNode, int depth, const Topic &topic) {
   if (currentNode == nullptr)
     return new Node(topic);
 
+  ++currentNode->subtreeSize;
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    currentNode->minCoordinates[dimension] =
+      std::min(currentNode->minCoordinates[dimension],
+               topic.coordinateAt(dimension));
+    currentNode->maxCoordinates[dimension] =
+      std::max(currentNode->maxCoordinates[dimension],
+               topic.coordinateAt(dimension));
+    currentNode->coordinateSums[dimension] += topic.coordinateAt(dimension);
+  }
+  currentNode->minCreatedAt =
+    std::min(currentNode->minCreatedAt, topic.getCreatedAt());
+  currentNode->maxExpiresAt =
+    std::max(currentNode->maxExpiresAt, topic.getExpiresAt());
+
+  // Plain stores: only insertConcurrent needs the compare-and-swap.
   int depthParity = depth & 1;
-  if (topic.coordinateAt(depthParity) <
-      currentNode->topic.coordinateAt(depthParity)) {
-    currentNode->left = insert(currentNode->left, depth + 1, topic);
+  atomic<Node*> &child = topic.coordinateAt(depthParity) <
+    currentNode->topic.coordinateAt(depthParity) ?
+    currentNode->left : currentNode->right;
+  child.store(insert(child.load(memory_order_relaxed), depth + 1, topic),
+              memory_order_release);
+  return currentNode;
+}
+
+void KDTree::updateSummary(Node *currentNode) {
+  currentNode->subtreeSize = 1;
+  for (int dimension = 0; dimension < 2; ++dimension) {
+    currentNode->minCoordinates[dimension] =
+      currentNode->topic.coordinateAt(dimension);
+    currentNode->maxCoordinates[dimension] =
+      currentNode->topic.coordinateAt(dimension);
+    currentNode->coordinateSums[dimension] =
+      currentNode->topic.coordinateAt(dimension);
+  }
+  currentNode->minCreatedAt = currentNode->topic.getCreatedAt();
+  currentNode->maxExpiresAt = currentNode->topic.getExpiresAt();
+  for (const Node *child : {currentNode->left.load(),
+                            currentNode->right.load()}) {
+    if (child == nullptr)
+      continue;
+    currentNode->subtreeSize += child->subtreeSize;
+    for (int dimension = 0; dimension < 2; ++dimension) {
+      currentNode->minCoordinates[dimension] =
+        std::min(currentNode->minCoordinates[dimension],
+                 child->minCoordinates[dimension]);
+      currentNode->maxCoordinates[dimension] =
+        std::max(currentNode->maxCoordinates[dimension],
+                 child->maxCoordinates[dimension]);
+      currentNode->coordinateSums[dimension] +=
+        child->coordinateSums[dimension];
+    }
+    currentNode->minCreatedAt =
+      std::min(currentNode->minCreatedAt, child->minCreatedAt);
+    currentNode->maxExpiresAt =
+      std::max(currentNode->maxExpiresAt, child->maxExpiresAt);
+  }
+}
+
+// Node holding the smallest coordinate along dimension in this subtree.
+Node* KDTree::findMin(Node *currentNode, int depth, int dimension) const {
+  if (currentNode == nullptr)
+    return nullptr;
+
+  Node *minNode = findMin(currentNode->left, depth + 1, dimension);
+  if ((depth & 1) != dimension) {
+    Node *rightMin = findMin(currentNode->right, depth + 1, dimension);
+    if (minNode == nullptr || (rightMin != nullptr &&
+        rightMin->topic.coordinateAt(dimension) <
+        minNode->topic.coordinateAt(dimension)))
+      minNode = rightMin;
+  }
+  if (minNode == nullptr || currentNode->topic.coordinateAt(dimension) <=
+      minNode->topic.coordinateAt(dimension))
+    minNode = currentNode;
+  return minNode;
+}
+
+// No reader runs alongside a remove, so the links are stored relaxed.
+Node* KDTree::remove(Node *currentNode, int depth, const Topic &topic) {
+  if (currentNode == nullptr)
+    return nullptr;
+
+  int depthParity = depth & 1;
+  if (currentNode->topic.getId() == topic.getId()) {
+    // Replace the topic with the minimum of the right subtree along the
+    // splitting axis, or move the left subtree to the right and take its
+    // minimum, so every topic on the right stays no less than the split.
+    if (currentNode->right == nullptr && currentNode->left == nullptr) {
+      delete currentNode;
+      return nullptr;
+    }
+    if (currentNode->right == nullptr) {
+      currentNode->right.store(currentNode->left, memory_order_relaxed);
+      currentNode->left.store(nullptr, memory_order_relaxed);
+    }
+    currentNode->topic =
+      findMin(currentNode->right, depth + 1, depthParity)->topic;
+    currentNode->right.store(
+      remove(currentNode->right, depth + 1, currentNode->topic),
+      memory_order_relaxed);
   } else {
-    currentNode->right = insert(currentNode->right, depth + 1, topic);
+    atomic<Node*> &child = topic.coordinateAt(depthParity) <
+      currentNode->topic.coordinateAt(depthParity) ?
+      currentNode->left : currentNode->right;
+    child.store(remove(child, depth + 1, topic), memory_order_relaxed);
   }
+  updateSummary(currentNode);
   return currentNode;
 }
 
 void KDTree::kNNTopics(
     Node *currentNode, int depth, const vector<double> &queryPosition) const {
-  if (currentNode == nullptr)
+  if (currentNode == nullptr || currentNode->deadAt(queryTime))
     return;
+  ++nodeVisits;
+  if (depth > maxDepthVisited)
+    maxDepthVisited = depth;
 
   int depthParity = depth & 1;
-  topicSet.insert(currentNode->topic);
+  if (currentNode->topic.isLiveAt(queryTime)) {
+    topicSet.insert(currentNode->topic);
 
-  while (static_cast<int>(topicSet.size()) > numResults)
-    topicSet.erase(prev(topicSet.cend()));
+    while (static_cast<int>(topicSet.size()) > numResults)
+      topicSet.erase(prev(topicSet.cend()));
+  }
 
   // Select first node to traverse next.
   Node *firstNode = nullptr, *secondNode = nullptr;
@@ -106,46 +251,65 @@ void KDTree::kNNTopics(
 
     if (dist1 < dist2) {
       kNNTopics(secondNode, depth + 1, queryPosition);
+    } else if (secondNode != nullptr) {
+      ++nodePrunes;
     }
   }
 }
 
-void KDTree::kNNQuestions(
-    Node *currentNode, int depth, const vector<double> &queryPosition) const {
-  if (currentNode == nullptr)
+void KDTree::kNNTopics(const Node *currentNode, int depth,
+                       const vector<double> &position, int k, double time,
+                       ResultHeap *results, const Node *skippedNode) const {
+  if (currentNode == nullptr || currentNode == skippedNode || k <= 0 ||
+      currentNode->deadAt(time))
     return;
+  ++nodeVisits;
+  if (depth > maxDepthVisited)
+    maxDepthVisited = depth;
 
   int depthParity = depth & 1;
-  for (int questionIndex :
-       topics[currentNode->topic.getId()].getQuestionIds()) {
-    auto iter = closestQuestionTopic.find(questionIndex);
-    if (iter == closestQuestionTopic.cend()) {
-      closestQuestionTopic[questionIndex] = currentNode->topic.getId();
-      questionSet.insert(questions[questionIndex]);
-    } else {
-      int topicId = iter->second;
-      double dist1 =
-        hypot(topics[topicId].getX() - queryPosition[0],
-              topics[topicId].getY() - queryPosition[1]);
-      double dist2 =
-        hypot(topics[currentNode->topic.getId()].getX() - queryPosition[0],
-              topics[currentNode->topic.getId()].getY() - queryPosition[1]);
-
-      if (compareDouble(dist1, dist2) ||
-          (fabs(dist1 - dist2) <= EPSILON &&
-           currentNode->topic.getId() > topicId)) {
-        questionSet.erase(questions[questionIndex]);
-        iter->second = currentNode->topic.getId();
-        questionSet.insert(questions[questionIndex]);
-      }
-    }
+  if (currentNode->topic.isLiveAt(time)) {
+    results->emplace(hypot(position[0] - currentNode->topic.getX(),
+                           position[1] - currentNode->topic.getY()),
+                     currentNode->topic.getId());
+    if (static_cast<int>(results->size()) > k)
+      results->pop();
   }
 
-  while (static_cast<int>(questionSet.size()) > numResults) {
-    const auto iter = prev(questionSet.cend());
-    closestQuestionTopic.erase(iter->getId());
-    questionSet.erase(iter);
+  const Node *firstNode = nullptr, *secondNode = nullptr;
+  if (position[depthParity] < currentNode->topic.coordinateAt(depthParity)) {
+    firstNode = currentNode->left;
+    secondNode = currentNode->right;
+  } else {
+    firstNode = currentNode->right;
+    secondNode = currentNode->left;
+  }
+
+  kNNTopics(firstNode, depth + 1, position, k, time, results, skippedNode);
+
+  if (static_cast<int>(results->size()) < k ||
+      fabs(position[depthParity] -
+           currentNode->topic.coordinateAt(depthParity)) <
+      results->top().first) {
+    kNNTopics(secondNode, depth + 1, position, k, time, results,
+              skippedNode);
+  } else if (secondNode != nullptr) {
+    ++nodePrunes;
   }
+}
+
+void KDTree::kNNQuestions(
+    Node *currentNode, int depth, const vector<double> &queryPosition) const {
+  if (currentNode == nullptr || currentNode->deadAt(queryTime))
+    return;
+  ++nodeVisits;
+  if (depth > maxDepthVisited)
+    maxDepthVisited = depth;
+
+  int depthParity = depth & 1;
+  if (currentNode->topic.isLiveAt(queryTime))
+    offerQuestionsOf(currentNode->topic.getId(), queryPosition);
+  trimQuestionSet();
 
   // Select first node to traverse next.
   Node *firstNode = nullptr, *secondNode = nullptr;
@@ -175,14 +339,21 @@ void KDTree::kNNQuestions(
 
     if (dist1 < dist2) {
       kNNQuestions(secondNode, depth + 1, queryPosition);
+    } else if (secondNode != nullptr) {
+      ++nodePrunes;
     }
   }
 }
 
+// A topic line may end with the creation and expiry times of the topic.
 istream& operator>> (istream &in, Topic &topic) {
   in >> topic.id;
   in >> topic.coordinates[0];
   in >> topic.coordinates[1];
+  while (in.peek() == ' ' || in.peek() == '\t' || in.peek() == '\r')
+    in.get();
+  if (in && in.peek() != '\n' && in.peek() != istream::traits_type::eof())
+    in >> topic.createdAt >> topic.expiresAt;
   return in;
 }
 
@@ -196,6 +367,25 @@ istream& operator>> (istream &in, Question &question) {
   return in;
 }
 
+InputReader& operator>> (InputReader &in, Topic &topic) {
+  in >> topic.id;
+  in >> topic.coordinates[0];
+  in >> topic.coordinates[1];
+  if (in && !in.atLineEnd())
+    in >> topic.createdAt >> topic.expiresAt;
+  return in;
+}
+
+InputReader& operator>> (InputReader &in, Question &question) {
+  int topicId;
+  in >> question.id >> question.topicCount;
+  for (int i = 0; i < question.topicCount; ++i) {
+    in >> topicId;
+    topics[topicId].getQuestionIds().push_back(question.getId());
+  }
+  return in;
+}
+
 // Topic compare function for ordering inside a set.
 bool operator< (const Topic &topic1, const Topic &topic2) {
   double dist1 = hypot(topic1.getX() - queryPosition[0],
@@ -229,20 +419,154 @@ bool operator< (const Question &question1, const Question &question2) {
   return question1.getId() > question2.getId();
 }
 
-void inputQuestion() {
+void inputQuestion(InputReader *input) {
   Question currentQuestion;
-  cin >> currentQuestion;
+  *input >> currentQuestion;
   questions[currentQuestion.getId()] = currentQuestion;
+  maxQuestionId = std::max(maxQuestionId, currentQuestion.getId());
 }
 
-const Topic& inputTopic() {
+const Topic& inputTopic(InputReader *input) {
   Topic currentTopic;
-  cin >> currentTopic;
+  *input >> currentTopic;
   return topics[currentTopic.getId()] = currentTopic;
 }
 
-template <typename T>
-void printSet(const set<T> &itemSet) {
+const vector<int>& questionIdsOf(int topicId) {
+  thread_local vector<int> decodedQuestionIds;
+  if (questionAdjacency.decode(topicId, &decodedQuestionIds))
+    return decodedQuestionIds;
+  // Readers may run on several threads, so an unknown id must not insert.
+  auto iter = topics.find(topicId);
+  if (iter == topics.end()) {
+    decodedQuestionIds.clear();
+    return decodedQuestionIds;
+  }
+  return iter->second.getQuestionIds();
+}
+
+void offerQuestionsOf(int topicId, const vector<double> &queryPosition) {
+  const vector<int> &questionIds = questionIdsOf(topicId);
+  questionTouches += questionIds.size();
+  const Topic &topic = topics.at(topicId);
+  double dist2 = hypot(topic.getX() - queryPosition[0],
+                       topic.getY() - queryPosition[1]);
+  for (int questionIndex : questionIds) {
+    bool indexed = questionIndex >= 0 &&
+      questionIndex < static_cast<int>(closestTopicOf.size());
+    if (visitedQuestions.insert(questionIndex)) {
+      closestQuestionTopic[questionIndex] = topicId;
+      if (indexed)
+        closestTopicOf[questionIndex] = DistanceResult(dist2, topicId);
+      questionSet.insert(questions[questionIndex]);
+      continue;
+    }
+
+    DistanceResult closest;
+    if (indexed) {
+      closest = closestTopicOf[questionIndex];
+    } else {
+      const Topic &closestTopic =
+        topics.at(closestQuestionTopic.find(questionIndex)->second);
+      closest = DistanceResult(
+        hypot(closestTopic.getX() - queryPosition[0],
+              closestTopic.getY() - queryPosition[1]),
+        closestTopic.getId());
+    }
+    double dist1 = closest.first;
+    if (compareDouble(dist1, dist2) ||
+        (fabs(dist1 - dist2) <= EPSILON && topicId > closest.second)) {
+      questionSet.erase(questions[questionIndex]);
+      closestQuestionTopic[questionIndex] = topicId;
+      if (indexed)
+        closestTopicOf[questionIndex] = DistanceResult(dist2, topicId);
+      questionSet.insert(questions[questionIndex]);
+    }
+  }
+}
+
+void trimQuestionSet() {
+  while (static_cast<int>(questionSet.size()) > numResults) {
+    const auto iter = prev(questionSet.cend());
+    closestQuestionTopic.erase(iter->getId());
+    visitedQuestions.erase(iter->getId());
+    questionSet.erase(iter);
+  }
+}
+
+// Adding an id already present replaces its topic, which keeps the
+// questions linked to it.
+void addTopic(const Topic &topic) {
+  Topic addedTopic = topic;
+  auto iter = topics.find(topic.getId());
+  if (iter != topics.cend()) {
+    kdtree.remove(iter->second);
+    subscriptions.notifyRemove(iter->second);
+    addedTopic.getQuestionIds() = iter->second.getQuestionIds();
+  }
+  kdtree.insert(topics[topic.getId()] = addedTopic);
+  subscriptions.notifyInsert(addedTopic);
+  metrics.recordUpdate();
+  metrics.setIndexSize(topics.size(), questions.size());
+}
+
+void moveTopic(int topicId, double x, double y) {
+  auto iter = topics.find(topicId);
+  if (iter == topics.cend())
+    return;
+
+  Topic movedTopic(topicId, x, y);
+  movedTopic.getQuestionIds() = iter->second.getQuestionIds();
+  movedTopic.setLifetime(iter->second.getCreatedAt(),
+                         iter->second.getExpiresAt());
+  kdtree.remove(iter->second);
+  subscriptions.notifyRemove(iter->second);
+  kdtree.insert(iter->second = movedTopic);
+  subscriptions.notifyInsert(movedTopic);
+  metrics.recordUpdate();
+}
+
+// Reinserted like a move so that the time spans along its path are
+// recomputed; subscriptions do not look at lifetimes.
+void setTopicLifetime(int topicId, double createdAt, double expiresAt) {
+  auto iter = topics.find(topicId);
+  if (iter == topics.cend())
+    return;
+
+  kdtree.remove(iter->second);
+  iter->second.setLifetime(createdAt, expiresAt);
+  kdtree.insert(iter->second);
+  metrics.recordUpdate();
+}
+
+void linkQuestion(int questionId, int topicId) {
+  auto iter = topics.find(topicId);
+  if (iter == topics.cend())
+    return;
+
+  questionAdjacency.release(&iter->second);
+  iter->second.getQuestionIds().push_back(questionId);
+  questions[questionId] =
+    Question(questionId, questions[questionId].getTopicCount() + 1);
+  maxQuestionId = std::max(maxQuestionId, questionId);
+  metrics.recordUpdate();
+  metrics.setIndexSize(topics.size(), questions.size());
+}
+
+QueryScope::~QueryScope() {
+  // Inner scopes leave the containers to the query around them, whose
+  // arena scope is still open.
+  if (queryArena().scopeDepth() > 1)
+    return;
+  // The containers must not keep pointers into the arena once it rewinds;
+  // only the hash map holds on to its bucket array after being cleared.
+  topicSet.clear();
+  questionSet.clear();
+  ClosestTopicMap().swap(closestQuestionTopic);
+}
+
+template <typename Container>
+void printSet(const Container &itemSet) {
   bool isFirstElem = true;
   for (const auto &iter : itemSet) {
     if (!isFirstElem)
@@ -253,46 +577,139 @@ void printSet(const set<T> &itemSet) {
   cout << std::endl;
 }
 
+template void printSet(const TopicSet &itemSet);
+template void printSet(const QuestionSet &itemSet);
+
 void solve() {
   int T, Q, N;
   char queryType;
 
-  cin >> T >> Q >> N;
+  // Long runs can be watched through a metrics file named in the
+  // environment, rewritten every ten seconds and when the run ends.
+  MetricsExporter exporter;
+  if (const char *metricsPath = getenv("NEARBY_METRICS_FILE"))
+    exporter.start(metricsPath, 10.0);
+
+  // Queries slower than NEARBY_SLOW_QUERY_MS milliseconds are kept in the
+  // slow query log, which is written to NEARBY_SLOW_QUERY_FILE, or to the
+  // standard error, on SIGUSR1 and when the run ends.
+  const char *slowQueryMillis = getenv("NEARBY_SLOW_QUERY_MS");
+  const char *slowQueryPath = getenv("NEARBY_SLOW_QUERY_FILE");
+  if (slowQueryMillis != nullptr) {
+    slowQueries.setThreshold(atof(slowQueryMillis) * 1e-3);
+    std::signal(SIGUSR1, requestSlowQueryDump);
+  }
+  auto dumpSlowQueries = [slowQueryPath]() {
+    if (slowQueryPath != nullptr)
+      slowQueries.dump(string(slowQueryPath));
+    else
+      slowQueries.dump(std::cerr);
+  };
+
+  steady_clock::time_point buildStart = steady_clock::now();
+  InputReader input(STDIN_FILENO);
+  input >> T >> Q >> N;
+  NEARBY_PROBE2(build__start, T, Q);
 
   for (int i = 1; i <= T; ++i) {
-    const Topic &currentTopic = inputTopic();
+    const Topic &currentTopic = inputTopic(&input);
     kdtree.insert(currentTopic);
   }
+  NEARBY_PROBE1(build__topics, T);
 
   for (int i = 1; i <= Q; ++i) {
-    inputQuestion();
+    inputQuestion(&input);
   }
+  NEARBY_PROBE1(build__questions, Q);
+  closestTopicOf.resize(maxQuestionId + 1);
+  questionAdjacency.build(&topics);
+  NEARBY_PROBE1(build__adjacency, questionAdjacency.memoryBytes());
+  kdtree.buildJumpTable();
+  NEARBY_PROBE1(build__end, T);
+  metrics.recordBuild(
+    duration<double>(steady_clock::now() - buildStart).count());
+  metrics.setIndexSize(topics.size(), questions.size());
 
   for (int i = 0; i < N; ++i) {
-    cin >> queryType;
-    cin >> numResults >> queryPosition[0] >> queryPosition[1];
-
+    input >> queryType;
+    input >> numResults >> queryPosition[0] >> queryPosition[1];
+    // Upper case types are the same queries restricted to topics live at
+    // the time given after the position.
+    queryTime = ANY_TIME;
+    if (queryType == 'T' || queryType == 'Q')
+      input >> queryTime;
+
+    steady_clock::time_point queryStart = steady_clock::now();
+    uint64_t visitsBefore = nodeVisits;
+    uint64_t prunesBefore = nodePrunes;
+    uint64_t touchesBefore = questionTouches;
+    maxDepthVisited = 0;
+    NEARBY_PROBE2(query__start, queryType, numResults);
+    Metrics::QueryType type;
+    QueryScope scope;
     switch (queryType) {
       case 't':
+      case 'T':
+        type = queryType == 't' ?
+          Metrics::TOPIC_QUERY : Metrics::TIMED_TOPIC_QUERY;
         topicSet.clear();
         kdtree.kNNTopics(queryPosition);
-        printSet(topicSet);
         break;
       case 'q':
+      case 'Q':
+        type = queryType == 'q' ?
+          Metrics::QUESTION_QUERY : Metrics::TIMED_QUESTION_QUERY;
         questionSet.clear();
         closestQuestionTopic.clear();
+        visitedQuestions.configure(maxQuestionId, numResults);
         kdtree.kNNQuestions(queryPosition);
-        printSet(questionSet);
         break;
       default:
-        break;
+        NEARBY_PROBE3(query__end, queryType, numResults, 0);
+        continue;
+    }
+    NEARBY_PROBE3(query__end, queryType, numResults,
+                  nodeVisits - visitsBefore);
+    double seconds =
+      duration<double>(steady_clock::now() - queryStart).count();
+    metrics.recordQuery(type, seconds, nodeVisits - visitsBefore);
+
+    if (slowQueries.isSlow(seconds)) {
+      SlowQuery slowQuery;
+      slowQuery.type = queryType;
+      slowQuery.numResults = numResults;
+      slowQuery.x = queryPosition[0];
+      slowQuery.y = queryPosition[1];
+      slowQuery.time = queryTime;
+      slowQuery.seconds = seconds;
+      slowQuery.nodesVisited = nodeVisits - visitsBefore;
+      slowQuery.prunes = nodePrunes - prunesBefore;
+      slowQuery.questionTouches = questionTouches - touchesBefore;
+      slowQuery.maxDepth = maxDepthVisited;
+      slowQueries.record(slowQuery);
+    }
+    // Printed once the clock has stopped, so that the latencies above are
+    // those of the search and not of the output.
+    if (queryType == 't' || queryType == 'T')
+      printSet(topicSet);
+    else
+      printSet(questionSet);
+    if (slowQueryDumpRequested) {
+      slowQueryDumpRequested = 0;
+      dumpSlowQueries();
     }
   }
+  if (slowQueryMillis != nullptr)
+    dumpSlowQueries();
 }
 
 }  // namespace NearbySolver
 
+// Tools built against the solver, such as those in tools/, define
+// NEARBY_NO_MAIN and bring their own.
+#ifndef NEARBY_NO_MAIN
 int main() {
   NearbySolver::solve();
   return 0;
 }
+#endif
@@ -6,49 +6,137 @@
 #ifndef _NEARBY_H
 #define _NEARBY_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <queue>
+#include <set>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "./query_arena.h"
+#include "./question_bitmap.h"
+
 namespace NearbySolver {
 
+using std::atomic;
 using std::istream;
+using std::pair;
+using std::priority_queue;
+using std::set;
+using std::unordered_map;
 using std::vector;
 
 class Topic;
 class Question;
 class Node;
 class KDTree;
+class JumpTable;
+class GroupQuestions;
+class InputReader;
 
 constexpr double EPSILON = 1e-3;
+
+// Query time that matches every topic regardless of its lifetime; NaN so
+// that every comparison against a lifetime fails.
+constexpr double ANY_TIME = std::numeric_limits<double>::quiet_NaN();
 constexpr bool compareDouble(const double &a, const double &b) {
   return (a - b) > EPSILON;
 }
 
+// A (distance, topic id) pair produced by a search.
+typedef pair<double, int> DistanceResult;
+
+// Orders results like the topic set: closer first, larger id first on ties.
+inline bool closerResult(const DistanceResult &result1,
+                         const DistanceResult &result2) {
+  if (compareDouble(result1.first, result2.first))
+    return false;
+  else if (compareDouble(result2.first, result1.first))
+    return true;
+  return result1.second > result2.second;
+}
+
+struct CloserResult {
+  bool operator() (const DistanceResult &result1,
+                   const DistanceResult &result2) const {
+    return closerResult(result1, result2);
+  }
+};
+
+// Max-heap whose top is the worst of the results kept so far.
+typedef priority_queue<DistanceResult, vector<DistanceResult>, CloserResult>
+  ResultHeap;
+
+// Aggregated marker for the topics of a subtree in a level-of-detail query.
+class TopicCluster {
+ public:
+  TopicCluster() = default;
+  TopicCluster(double x, double y, int count) : x(x), y(y), count(count) {}
+  double getX() const { return x; }
+  double getY() const { return y; }
+  int getCount() const { return count; }
+
+ private:
+  double x = 0.0;
+  double y = 0.0;
+  int count = 0;
+};
+
+// How the distances to the points of a group query are combined.
+enum GroupAggregate { GROUP_MIN, GROUP_SUM };
+
 class Topic {
  public:
   Topic() = default;
+  Topic(int id, double x, double y) : id(id), coordinates{x, y} {}
   ~Topic() = default;
   double getX() const { return coordinates[0]; }
   double getY() const { return coordinates[1]; }
   double coordinateAt(int dimension) const { return coordinates[dimension]; }
   int getId() const { return id; }
+  // A topic is live from its creation time up to but excluding its expiry;
+  // by default it always is.
+  double getCreatedAt() const { return createdAt; }
+  double getExpiresAt() const { return expiresAt; }
+  void setLifetime(double created, double expires) {
+    createdAt = created;
+    expiresAt = expires;
+  }
+  bool isLiveAt(double time) const {
+    return !(time < createdAt || time >= expiresAt);
+  }
   vector<int>& getQuestionIds() { return questionIds; }
+  const vector<int>& getQuestionIds() const { return questionIds; }
 
   friend bool operator< (const Topic &topic1, const Topic &topic2);
   friend istream& operator>> (istream &in, Topic &topic);
+  friend InputReader& operator>> (InputReader &in, Topic &topic);
 
  private:
   int id = 0;
   vector<int> questionIds;
-  vector<double> coordinates = {0.0, 0.0};
+  // Kept inline so that copying a topic into a result set allocates
+  // nothing once its question list has moved to the compressed adjacency.
+  double coordinates[2] = {0.0, 0.0};
+  double createdAt = -std::numeric_limits<double>::infinity();
+  double expiresAt = std::numeric_limits<double>::infinity();
 };
 
 class Question {
  public:
   Question() = default;
+  Question(int id, int topicCount) : id(id), topicCount(topicCount) {}
   ~Question() = default;
   int getId() const { return id; }
+  int getTopicCount() const { return topicCount; }
   friend bool operator< (const Question &question1, const Question &question2);
   friend istream& operator>> (istream &in, Question &question);
+  friend InputReader& operator>> (InputReader &in, Question &question);
 
  private:
   int id = 0;
@@ -60,14 +148,101 @@ class Node {
   Node() = default;
   ~Node() = default;
   explicit Node(const Topic &next) :
-    left(nullptr), right(nullptr), topic(next) {}
+    topic(next), left(nullptr), right(nullptr),
+    minCoordinates{next.getX(), next.getY()},
+    maxCoordinates{next.getX(), next.getY()},
+    coordinateSums{next.getX(), next.getY()},
+    minCreatedAt(next.getCreatedAt()), maxExpiresAt(next.getExpiresAt()) {}
+
+  // Axis-aligned box, as copied from a subtree by getBox. The other spatial
+  // indexes keep their bounds in it too.
+  class Box {
+   public:
+    double minCorner[2];
+    double maxCorner[2];
+
+    // Box that contains nothing and grows to the first point extended in.
+    static Box empty() {
+      const double infinity = std::numeric_limits<double>::infinity();
+      return {{infinity, infinity}, {-infinity, -infinity}};
+    }
+    void extend(double x, double y) {
+      minCorner[0] = std::min(minCorner[0], x);
+      minCorner[1] = std::min(minCorner[1], y);
+      maxCorner[0] = std::max(maxCorner[0], x);
+      maxCorner[1] = std::max(maxCorner[1], y);
+    }
+    void extend(const Box &other) {
+      extend(other.minCorner[0], other.minCorner[1]);
+      extend(other.maxCorner[0], other.maxCorner[1]);
+    }
+    // Distance from the point to the nearest point of the box, zero if the
+    // box contains it.
+    double distanceTo(double x, double y) const {
+      return std::hypot(std::max({minCorner[0] - x, 0.0, x - maxCorner[0]}),
+                        std::max({minCorner[1] - y, 0.0, y - maxCorner[1]}));
+    }
+    double distanceTo(const vector<double> &position) const {
+      return distanceTo(position[0], position[1]);
+    }
+    // Smallest distance between a point of this box and one of the other.
+    double distanceTo(const Box &other) const {
+      return std::hypot(std::max({other.minCorner[0] - maxCorner[0], 0.0,
+                                  minCorner[0] - other.maxCorner[0]}),
+                        std::max({other.minCorner[1] - maxCorner[1], 0.0,
+                                  minCorner[1] - other.maxCorner[1]}));
+    }
+  };
 
  private:
   Topic topic;
-  Node *left = nullptr;
-  Node *right = nullptr;
+  // Child links are atomic so that concurrent inserts can publish a new
+  // leaf with a single compare-and-swap; see insertConcurrent.
+  atomic<Node*> left{nullptr};
+  atomic<Node*> right{nullptr};
+  // Number of topics and bounding box of the subtree rooted here.
+  int subtreeSize = 1;
+  double minCoordinates[2] = {0.0, 0.0};
+  double maxCoordinates[2] = {0.0, 0.0};
+  // Sum of the coordinates of the subtree's topics, for its centroid.
+  double coordinateSums[2] = {0.0, 0.0};
+  // Span of time in which some topic of the subtree may be live.
+  double minCreatedAt = -std::numeric_limits<double>::infinity();
+  double maxExpiresAt = std::numeric_limits<double>::infinity();
+
+  // The summary above as searches read it. insertConcurrent widens it with
+  // atomic read-modify-writes while searches run, so every read is a
+  // relaxed atomic load, which costs no more than a plain one.
+  static double loadRelaxed(const double &field) {
+    double value;
+    __atomic_load(&field, &value, __ATOMIC_RELAXED);
+    return value;
+  }
+  int getSubtreeSize() const {
+    return __atomic_load_n(&subtreeSize, __ATOMIC_RELAXED);
+  }
+  double getMinCoordinate(int dimension) const {
+    return loadRelaxed(minCoordinates[dimension]);
+  }
+  double getMaxCoordinate(int dimension) const {
+    return loadRelaxed(maxCoordinates[dimension]);
+  }
+  double getCoordinateSum(int dimension) const {
+    return loadRelaxed(coordinateSums[dimension]);
+  }
+  Box getBox() const {
+    return {{getMinCoordinate(0), getMinCoordinate(1)},
+            {getMaxCoordinate(0), getMaxCoordinate(1)}};
+  }
+
+  // Whether no topic of the subtree is live at the time.
+  bool deadAt(double time) const {
+    return time < loadRelaxed(minCreatedAt) ||
+      time >= loadRelaxed(maxExpiresAt);
+  }
 
   friend class KDTree;
+  friend class JumpTable;
 };
 
 class KDTree {
@@ -79,21 +254,195 @@ class KDTree {
                  const vector<double> &queryPosition) const;
   void kNNQuestions(Node *currentNode, int depth,
                     const vector<double> &queryPosition) const;
+  // Skips the subtree of skippedNode, which the caller already searched.
+  void kNNTopics(const Node *currentNode, int depth,
+                 const vector<double> &position, int k, double time,
+                 ResultHeap *results, const Node *skippedNode = nullptr) const;
   void insert(const Topic &topic) {
-    root = insert(root, false, topic);
+    root.store(insert(root.load(std::memory_order_relaxed), false, topic),
+               std::memory_order_release);
   }
+  // Insert that may run on several threads at once and alongside readers.
+  // A reader sees each topic either fully inserted or not at all; readers
+  // must use the reentrant searches and the aggregate queries, which only
+  // prune on bounding boxes that are widened before a leaf is published.
+  // remove and the other updates still require writers and readers to stop.
+  void insertConcurrent(const Topic &topic);
+  // Rebuilds the tree balanced from its current topics, which concurrent
+  // inserts in arrival order do not keep, and retires the old nodes through
+  // the epoch manager. The reentrant searches and the aggregate queries
+  // hold an EpochGuard while they run, so they may keep running; no writer
+  // may run alongside.
+  void rebalance();
+  // Removes the topic with this id stored at the topic's coordinates, and
+  // rebuilds the jump table if there is one.
+  void remove(const Topic &topic);
   void kNNTopics(const vector<double> &queryPosition) const {
     kNNTopics(root, false, queryPosition);
   }
   void kNNQuestions(const vector<double> &queryPosition) const {
     kNNQuestions(root, false, queryPosition);
   }
+  // Reentrant variant that keeps its results in the caller's heap instead
+  // of the shared topic set, so it may run on several threads at once.
+  // Only topics live at the time are found. Starts from the jump table when
+  // one is built; see jump_table.h.
+  void kNNTopics(const vector<double> &position, int k, ResultHeap *results,
+                 double time = ANY_TIME) const;
+  // Builds the grid directory used to start reentrant searches below the
+  // root. Inserts keep it valid; remove and rebalance rebuild it.
+  void buildJumpTable();
+
+  // Next k topics ordered strictly after the boundary result, used to
+  // resume a paginated search; see pagination.h. Results are kept as a heap
+  // under exact (distance, descending id) order rather than the EPSILON
+  // order, which is not transitive and so cannot split a ranking into pages.
+  void kNNTopicsAfter(const vector<double> &position, int k,
+                      const DistanceResult &boundary,
+                      vector<DistanceResult> *results) const;
+
+  // Aggregate queries; whole subtrees inside the region are counted
+  // without being visited. Boundaries are inclusive.
+  int size() const {
+    const Node *top = root;
+    return top == nullptr ? 0 : top->getSubtreeSize();
+  }
+  int countTopics(const vector<double> &center, double radius) const;
+  int countTopics(const vector<double> &minCorner,
+                  const vector<double> &maxCorner) const;
+  int countQuestions(const vector<double> &center, double radius) const;
+  int countQuestions(const vector<double> &minCorner,
+                     const vector<double> &maxCorner) const;
+  // Topic counts of a columns x rows grid of equal cells over the box,
+  // row-major from minCorner, gathered in a single traversal.
+  vector<int> densityGrid(const vector<double> &minCorner,
+                          const vector<double> &maxCorner,
+                          int columns, int rows) const;
+
+  // Group queries rank by the minimum or the sum of the distances to
+  // several points, in one traversal; ids are returned best first.
+  vector<int> groupNNTopics(const vector<vector<double>> &positions,
+                            GroupAggregate aggregate, int k) const;
+  vector<int> groupNNQuestions(const vector<vector<double>> &positions,
+                               GroupAggregate aggregate, int k) const;
+  // Reentrant question search feeding the caller's ranking, so that it can
+  // be combined with searches over other indexes.
+  void kNNQuestions(const vector<double> &position, GroupQuestions *results,
+                    double time = ANY_TIME) const;
+
+  // At most maxClusters clusters covering the topics in the box, one per
+  // subtree at the deepest level of the tree that has no more subtrees
+  // intersecting the box. Counts and centroids are those of whole subtrees,
+  // so topics just outside the box may be included.
+  vector<TopicCluster> clusters(const vector<double> &minCorner,
+                                const vector<double> &maxCorner,
+                                int maxClusters) const;
+
+  // The k topics within maxDistance of a polyline route that are closest to
+  // it, ordered by that distance; k = size() returns all of them.
+  vector<int> corridorTopics(const vector<vector<double>> &route,
+                             double maxDistance, int k) const;
 
  private:
-  Node *root = nullptr;
+  atomic<Node*> root{nullptr};
+  atomic<const JumpTable*> jumpTable{nullptr};
+  void dropJumpTable();
   void freeNodes(Node *currentNode);
+  void collectTopics(const Node *currentNode, vector<Topic> *result) const;
+  Node* build(vector<Topic> *allTopics, int begin, int end, int depth);
+  Node* remove(Node *currentNode, int depth, const Topic &topic);
+  Node* findMin(Node *currentNode, int depth, int dimension) const;
+  void updateSummary(Node *currentNode);
+  void kNNTopicsAfter(const Node *currentNode, const vector<double> &position,
+                      int k, const DistanceResult &boundary,
+                      vector<DistanceResult> *results) const;
+  template <typename Region>
+  int countTopics(const Node *currentNode, const Region &region) const;
+  template <typename Region>
+  void collectQuestions(const Node *currentNode, const Region &region,
+                        bool contained, QuestionBitmap *visited,
+                        int *count) const;
+  void densityGrid(const Node *currentNode, const double *minCorner,
+                   const double *cellSize, int columns, int rows,
+                   vector<int> *counts) const;
+  void groupNNTopics(const Node *currentNode,
+                     const vector<vector<double>> &positions,
+                     GroupAggregate aggregate, int k,
+                     ResultHeap *results) const;
+  void groupNNQuestions(const Node *currentNode,
+                        const vector<vector<double>> &positions,
+                        GroupAggregate aggregate, double time,
+                        GroupQuestions *results) const;
+  void corridorTopics(const Node *currentNode,
+                      const vector<vector<double>> &route, int begin, int end,
+                      vector<int> *segments, double maxDistance, int k,
+                      vector<DistanceResult> *results) const;
 };
 
+// Scratch containers of the shared query state, backed by the arena of
+// the thread that constructed them.
+typedef set<Topic, std::less<Topic>, ArenaAllocator<Topic>> TopicSet;
+typedef set<Question, std::less<Question>, ArenaAllocator<Question>>
+  QuestionSet;
+typedef unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                      ArenaAllocator<pair<const int, int>>> ClosestTopicMap;
+
+// Query state shared by the KD-Tree traversals; see nearby.cpp.
+extern int numResults;
+extern vector<double> queryPosition;
+// Only topics live at this time are considered by the shared-state
+// searches, or all of them when it is ANY_TIME.
+extern double queryTime;
+extern TopicSet topicSet;
+extern QuestionSet questionSet;
+extern unordered_map<int, Topic> topics;
+extern unordered_map<int, Question> questions;
+extern ClosestTopicMap closestQuestionTopic;
+extern QuestionBitmap visitedQuestions;
+// Largest question id loaded or linked so far, or -1, which sizes the
+// visited question bitmaps.
+extern int maxQuestionId;
+extern KDTree kdtree;
+
+// One query over the shared query state. When the outermost scope ends the
+// scratch containers are emptied and the arena behind them is released.
+class QueryScope {
+ public:
+  QueryScope() : arenaScope(&queryArena()) {}
+  ~QueryScope();
+  QueryScope(const QueryScope&) = delete;
+  QueryScope& operator= (const QueryScope&) = delete;
+
+ private:
+  QueryArena::Scope arenaScope;
+};
+
+// Question ids linked to a topic, decoded into a per-thread buffer when the
+// adjacency is compressed; valid until the next call on the same thread.
+// Empty for a topic that is not held.
+const vector<int>& questionIdsOf(int topicId);
+
+// Steps of the shared-state question search at one topic: its questions go
+// into questionSet, replacing a question's closest topic by the tie-break
+// rules, and the set is then trimmed back to numResults.
+void offerQuestionsOf(int topicId, const vector<double> &queryPosition);
+void trimQuestionSet();
+
+// Updates applied after the initial load, keeping the KD-Tree and any
+// standing subscriptions up to date.
+void addTopic(const Topic &topic);
+void moveTopic(int topicId, double x, double y);
+void setTopicLifetime(int topicId, double createdAt, double expiresAt);
+void linkQuestion(int questionId, int topicId);
+
+// Writes the ids of a result set to standard output on one line; defined
+// for TopicSet and QuestionSet.
+template <typename Container>
+void printSet(const Container &itemSet);
+
+// Reads the input from standard input and answers its queries.
+void solve();
+
 }  // namespace NearbySolver
 
 #endif  // _NEARBY_H
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Resumable nearest topic cursors for paginated results.
+ *
+ * A page is a k-NN search restricted to results ordered after the cursor's
+ * boundary. Pages use exact distances so that they tile the ranking without
+ * gaps or repeats; within EPSILON of each other, ties may therefore order
+ * differently from a single kNNTopics call. Subtrees whose furthest corner is
+ * still closer than the boundary hold only topics from earlier pages and are
+ * skipped outright, so deep pages do not repeat the work of earlier pages.
+ */
+
+#include "./pagination.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./epoch.h"
+
+namespace NearbySolver {
+
+using std::max;
+using std::numeric_limits;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+// Strict total order used for paging: closer first, larger id first on
+// exact ties.
+static bool exactlyCloser(const DistanceResult &result1,
+                          const DistanceResult &result2) {
+  if (result1.first != result2.first)
+    return result1.first < result2.first;
+  return result1.second > result2.second;
+}
+
+void KDTree::kNNTopicsAfter(const vector<double> &position, int k,
+                            const DistanceResult &boundary,
+                            vector<DistanceResult> *results) const {
+  EpochGuard guard;
+  kNNTopicsAfter(root, position, k, boundary, results);
+}
+
+void KDTree::kNNTopicsAfter(const Node *currentNode,
+                            const vector<double> &position, int k,
+                            const DistanceResult &boundary,
+                            vector<DistanceResult> *results) const {
+  if (currentNode == nullptr || k <= 0)
+    return;
+
+  const Node::Box box = currentNode->getBox();
+  if (static_cast<int>(results->size()) >= k &&
+      box.distanceTo(position) > results->front().first)
+    return;
+
+  double farX = max(fabs(box.minCorner[0] - position[0]),
+                    fabs(box.maxCorner[0] - position[0]));
+  double farY = max(fabs(box.minCorner[1] - position[1]),
+                    fabs(box.maxCorner[1] - position[1]));
+  if (hypot(farX, farY) < boundary.first)
+    return;
+
+  DistanceResult result(hypot(position[0] - currentNode->topic.getX(),
+                              position[1] - currentNode->topic.getY()),
+                        currentNode->topic.getId());
+  if (exactlyCloser(boundary, result)) {
+    if (static_cast<int>(results->size()) < k) {
+      results->push_back(result);
+      std::push_heap(results->begin(), results->end(), exactlyCloser);
+    } else if (exactlyCloser(result, results->front())) {
+      std::pop_heap(results->begin(), results->end(), exactlyCloser);
+      results->back() = result;
+      std::push_heap(results->begin(), results->end(), exactlyCloser);
+    }
+  }
+
+  // Descend into the side of the query point first.
+  const Node *firstNode = currentNode->left, *secondNode = currentNode->right;
+  if (secondNode != nullptr && firstNode != nullptr &&
+      secondNode->getBox().distanceTo(position) == 0.0)
+    std::swap(firstNode, secondNode);
+  kNNTopicsAfter(firstNode, position, k, boundary, results);
+  kNNTopicsAfter(secondNode, position, k, boundary, results);
+}
+
+TopicCursor::TopicCursor(const vector<double> &position) :
+  position(position),
+  boundary(-numeric_limits<double>::infinity(), 0) {}
+
+vector<int> TopicCursor::nextPage(int pageSize) {
+  vector<int> page;
+  if (exhausted || pageSize <= 0)
+    return page;
+
+  vector<DistanceResult> results;
+  kdtree.kNNTopicsAfter(position, pageSize, boundary, &results);
+  exhausted = static_cast<int>(results.size()) < pageSize;
+  if (results.empty())
+    return page;
+
+  std::sort_heap(results.begin(), results.end(), exactlyCloser);
+  boundary = results.back();
+  for (const auto &result : results)
+    page.push_back(result.second);
+  return page;
+}
+
+string TopicCursor::toToken() const {
+  ostringstream out;
+  out.precision(numeric_limits<double>::max_digits10);
+  out << position[0] << ':' << position[1] << ':' << boundary.first << ':'
+      << boundary.second;
+  return out.str();
+}
+
+bool TopicCursor::fromToken(const string &token, TopicCursor *cursor) {
+  const char *begin = token.c_str();
+  char *end = nullptr;
+  double fields[3];
+  for (double &field : fields) {
+    field = strtod(begin, &end);
+    if (end == begin || *end != ':')
+      return false;
+    begin = end + 1;
+  }
+  long topicId = strtol(begin, &end, 10);
+  if (end == begin || *end != '\0')
+    return false;
+
+  *cursor = TopicCursor({fields[0], fields[1]});
+  cursor->boundary = DistanceResult(fields[2], static_cast<int>(topicId));
+  return true;
+}
+
+}  // namespace NearbySolver
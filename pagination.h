@@ -0,0 +1,46 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Resumable nearest topic cursors for paginated results.
+ */
+
+#ifndef _PAGINATION_H
+#define _PAGINATION_H
+
+#include <string>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::string;
+using std::vector;
+
+class TopicCursor;
+
+// Walks the topics around a point one page at a time. The cursor only
+// remembers the last result it returned, so it round-trips through a short
+// token and stays valid across inserts: the next page is the k topics that
+// order strictly after that result, and subtrees lying entirely before it
+// are never entered again.
+class TopicCursor {
+ public:
+  TopicCursor() : TopicCursor({0.0, 0.0}) {}
+  ~TopicCursor() = default;
+  explicit TopicCursor(const vector<double> &position);
+  vector<int> nextPage(int pageSize);
+  bool isExhausted() const { return exhausted; }
+  // "x:y:distance:id", where the boundary distance is -inf before the first
+  // page.
+  string toToken() const;
+  static bool fromToken(const string &token, TopicCursor *cursor);
+
+ private:
+  vector<double> position = {0.0, 0.0};
+  bool exhausted = false;
+  DistanceResult boundary;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _PAGINATION_H
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * USDT static probes for tracing the solver with bpftrace or SystemTap.
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+#include <cstdint>
+
+// Every probe belongs to the provider "nearby" and takes up to three
+// integer arguments, each passed as a signed 64-bit value:
+//
+//   query__start(type, k)                 type is the query character
+//   query__end(type, k, nodesVisited)
+//   build__start(numTopics, numQuestions) loading the input into the index
+//   build__topics(numTopics)              topics read and inserted
+//   build__questions(numQuestions)        questions read and linked
+//   build__adjacency(bytes)               question lists compressed
+//   build__end(numTopics)
+//   jump__table__start(numTopics), jump__table__end(numTopics)
+//   rebalance__start(numTopics), rebalance__end(numTopics)
+//   partition__seal(numTopics)            time partition sealed
+//   snapshot__start(firstSegment), snapshot__end(firstSegment, ok)
+//   snapshot__load(firstSegment)          -1 when the snapshot was invalid
+//
+// A probe site is a single nop plus an ELF note naming it, in the format of
+// SystemTap's <sys/sdt.h>, so tracing needs no special build:
+//
+//   bpftrace -e 'usdt:./nearby:nearby:query__end { @[arg0] = hist(arg2); }'
+//
+// The header is used when installed. Otherwise the notes are emitted here
+// on x86-64, and the probes compile to nothing on other targets.
+
+#define NEARBY_PROBE_ARG(value) (static_cast<int64_t>(value))
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define NEARBY_HAVE_SYS_SDT 1
+#endif
+#endif
+
+#if defined(NEARBY_HAVE_SYS_SDT)
+
+#include <sys/sdt.h>
+
+#define NEARBY_PROBE0(name) DTRACE_PROBE(nearby, name)
+#define NEARBY_PROBE1(name, arg1) \
+  DTRACE_PROBE1(nearby, name, NEARBY_PROBE_ARG(arg1))
+#define NEARBY_PROBE2(name, arg1, arg2) \
+  DTRACE_PROBE2(nearby, name, NEARBY_PROBE_ARG(arg1), NEARBY_PROBE_ARG(arg2))
+#define NEARBY_PROBE3(name, arg1, arg2, arg3) \
+  DTRACE_PROBE3(nearby, name, NEARBY_PROBE_ARG(arg1), \
+                NEARBY_PROBE_ARG(arg2), NEARBY_PROBE_ARG(arg3))
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+// Version 3 stapsdt note: the probe address, the address of the
+// .stapsdt.base section the tracer uses to relocate it, a zero semaphore
+// address, then the provider, probe name and argument description. Each
+// argument is described as -8@operand, a signed 8-byte value wherever the
+// compiler put it.
+#define NEARBY_PROBE_NOTE(name, arguments) \
+  "990:\tnop\n" \
+  "\t.pushsection .note.stapsdt,\"?\",\"note\"\n" \
+  "\t.balign 4\n" \
+  "\t.4byte 992f-991f,994f-993f,3\n" \
+  "991:\t.asciz \"stapsdt\"\n" \
+  "992:\t.balign 4\n" \
+  "993:\t.8byte 990b\n" \
+  "\t.8byte _.stapsdt.base\n" \
+  "\t.8byte 0\n" \
+  "\t.asciz \"nearby\"\n" \
+  "\t.asciz \"" #name "\"\n" \
+  "\t.asciz \"" arguments "\"\n" \
+  "994:\t.balign 4\n" \
+  "\t.popsection\n" \
+  "\t.ifndef _.stapsdt.base\n" \
+  "\t.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  "\t.weak _.stapsdt.base\n" \
+  "\t.hidden _.stapsdt.base\n" \
+  "_.stapsdt.base:\t.space 1\n" \
+  "\t.size _.stapsdt.base,1\n" \
+  "\t.popsection\n" \
+  "\t.endif\n"
+
+#define NEARBY_PROBE0(name) \
+  __asm__ __volatile__(NEARBY_PROBE_NOTE(name, "") ::)
+#define NEARBY_PROBE1(name, arg1) \
+  __asm__ __volatile__(NEARBY_PROBE_NOTE(name, "-8@%[a1]") \
+                       :: [a1] "nor" (NEARBY_PROBE_ARG(arg1)))
+#define NEARBY_PROBE2(name, arg1, arg2) \
+  __asm__ __volatile__(NEARBY_PROBE_NOTE(name, "-8@%[a1] -8@%[a2]") \
+                       :: [a1] "nor" (NEARBY_PROBE_ARG(arg1)), \
+                          [a2] "nor" (NEARBY_PROBE_ARG(arg2)))
+#define NEARBY_PROBE3(name, arg1, arg2, arg3) \
+  __asm__ __volatile__( \
+    NEARBY_PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3]") \
+    :: [a1] "nor" (NEARBY_PROBE_ARG(arg1)), \
+       [a2] "nor" (NEARBY_PROBE_ARG(arg2)), \
+       [a3] "nor" (NEARBY_PROBE_ARG(arg3)))
+
+#else
+
+#define NEARBY_PROBE0(name) do {} while (0)
+#define NEARBY_PROBE1(name, arg1) do { (void)(arg1); } while (0)
+#define NEARBY_PROBE2(name, arg1, arg2) \
+  do { (void)(arg1); (void)(arg2); } while (0)
+#define NEARBY_PROBE3(name, arg1, arg2, arg3) \
+  do { (void)(arg1); (void)(arg2); (void)(arg3); } while (0)
+
+#endif
+
+#endif  // _PROBES_H
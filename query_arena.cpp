@@ -0,0 +1,89 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Per-thread monotonic arena for the scratch containers of a query.
+ *
+ * The ordered sets and the hash map of a query allocate one node per element
+ * and go back to the allocator for every insert and erase. Serving them from
+ * a bump pointer makes allocation a few instructions and keeps each thread
+ * off the shared heap, so queries on many threads do not contend on allocator
+ * locks. Erased nodes are recycled through per-size free lists, so a query
+ * that inserts and erases millions of times reuses the same few chunks
+ * instead of growing the arena with every operation.
+ */
+
+#include "./query_arena.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace NearbySolver {
+
+constexpr size_t QueryArena::CHUNK_BYTES;
+constexpr size_t QueryArena::MAX_RECYCLED_BYTES;
+constexpr size_t QueryArena::GRANULE;
+constexpr size_t QueryArena::SIZE_CLASSES;
+
+void* QueryArena::allocate(size_t bytes, size_t alignment) {
+  size_t sizeClass = QueryArena::sizeClass(bytes);
+  if (sizeClass == 0)
+    return bump(bytes, alignment);
+
+  FreeBlock *block = freeLists[sizeClass];
+  if (block != nullptr && alignment <= GRANULE) {
+    freeLists[sizeClass] = block->next;
+    return block;
+  }
+  // Every block of a class is carved at its full size so that any request
+  // of the class fits when it comes back from the free list.
+  return bump(sizeClass * GRANULE, std::max(alignment, GRANULE));
+}
+
+void QueryArena::recycle(void *block, size_t bytes) {
+  size_t sizeClass = QueryArena::sizeClass(bytes);
+  if (sizeClass == 0 || block == nullptr)
+    return;
+
+  FreeBlock *freeBlock = static_cast<FreeBlock*>(block);
+  freeBlock->next = freeLists[sizeClass];
+  freeLists[sizeClass] = freeBlock;
+}
+
+void* QueryArena::bump(size_t bytes, size_t alignment) {
+  while (chunkIndex < chunks.size()) {
+    size_t start = (offset + alignment - 1) & ~(alignment - 1);
+    if (start + bytes <= chunks[chunkIndex].second) {
+      offset = start + bytes;
+      return chunks[chunkIndex].first.get() + start;
+    }
+    ++chunkIndex;
+    offset = 0;
+  }
+
+  // Chunks grow with the arena so that large queries need few of them;
+  // new[] aligns to at least alignof(max_align_t).
+  size_t size = std::max({CHUNK_BYTES, bytes, capacity()});
+  chunks.emplace_back(unique_ptr<char[]>(new char[size]), size);
+  chunkIndex = chunks.size() - 1;
+  offset = bytes;
+  return chunks.back().first.get();
+}
+
+void QueryArena::release() {
+  chunkIndex = 0;
+  offset = 0;
+  std::fill(std::begin(freeLists), std::end(freeLists), nullptr);
+}
+
+size_t QueryArena::capacity() const {
+  size_t total = 0;
+  for (const auto &chunk : chunks)
+    total += chunk.second;
+  return total;
+}
+
+QueryArena& queryArena() {
+  thread_local QueryArena arena;
+  return arena;
+}
+
+}  // namespace NearbySolver
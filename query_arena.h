@@ -0,0 +1,127 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Per-thread monotonic arena for the scratch containers of a query.
+ */
+
+#ifndef _QUERY_ARENA_H
+#define _QUERY_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::pair;
+using std::size_t;
+using std::unique_ptr;
+using std::vector;
+
+class QueryArena;
+template <typename T> class ArenaAllocator;
+
+// Buffer that hands out memory by bumping a pointer through a list of
+// chunks. Freed blocks of up to MAX_RECYCLED_BYTES go on a free list per
+// size class and are handed out again, so the node churn of a long query
+// stays bounded by its live size; larger blocks are only reclaimed on
+// release. Releasing rewinds to the first chunk in constant time and keeps
+// the chunks for the next query, so a warmed-up thread stops calling into
+// the global heap.
+class QueryArena {
+ public:
+  static constexpr size_t CHUNK_BYTES = 64 << 10;
+  static constexpr size_t MAX_RECYCLED_BYTES = 256;
+
+  // Releases the arena when the outermost scope on it ends. Containers
+  // backed by the arena must have returned to an empty state by then.
+  class Scope {
+   public:
+    explicit Scope(QueryArena *arena) : arena(arena) { ++arena->depth; }
+    ~Scope() {
+      if (--arena->depth == 0)
+        arena->release();
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator= (const Scope&) = delete;
+
+   private:
+    QueryArena *arena;
+  };
+
+  QueryArena() = default;
+  ~QueryArena() = default;
+  QueryArena(const QueryArena&) = delete;
+  QueryArena& operator= (const QueryArena&) = delete;
+  void* allocate(size_t bytes, size_t alignment);
+  void recycle(void *block, size_t bytes);
+  void release();
+  size_t capacity() const;
+  // Number of scopes open on the arena.
+  int scopeDepth() const { return depth; }
+
+ private:
+  static constexpr size_t GRANULE = alignof(void*);
+  static constexpr size_t SIZE_CLASSES = MAX_RECYCLED_BYTES / GRANULE + 1;
+
+  // Recycled blocks link through their first word.
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  // Size class of a block, or 0 if it is not recycled.
+  static size_t sizeClass(size_t bytes) {
+    if (bytes == 0 || bytes > MAX_RECYCLED_BYTES)
+      return 0;
+    return (std::max(bytes, sizeof(FreeBlock)) + GRANULE - 1) / GRANULE;
+  }
+  void* bump(size_t bytes, size_t alignment);
+
+  // Chunks with their sizes; those after chunkIndex are free.
+  vector<pair<unique_ptr<char[]>, size_t>> chunks;
+  size_t chunkIndex = 0;
+  size_t offset = 0;
+  FreeBlock *freeLists[SIZE_CLASSES] = {};
+  int depth = 0;
+};
+
+// Arena of the calling thread.
+QueryArena& queryArena();
+
+// Standard allocator over a QueryArena; deallocation recycles small blocks.
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  ArenaAllocator() : arena(&queryArena()) {}
+  explicit ArenaAllocator(QueryArena *arena) : arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *block, size_t count) {
+    arena->recycle(block, count * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator== (const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+  template <typename U>
+  bool operator!= (const ArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+
+ private:
+  QueryArena *arena;
+
+  template <typename U> friend class ArenaAllocator;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _QUERY_ARENA_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Compressed topic to question adjacency.
+ *
+ * Question ids of a topic are sorted and stored as differences from the
+ * previous id, which mostly fit in one or two bytes. With SSSE3 available,
+ * groups of four values are expanded with a shuffle looked up from their
+ * control byte and turned back into ids with an in-register prefix sum; any
+ * remaining values, and builds without SSSE3, take the scalar path.
+ */
+
+#include "./question_adjacency.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::vector;
+
+QuestionAdjacency questionAdjacency;
+
+namespace {
+
+// Extra bytes after the data so a 16-byte load never reads past the end.
+constexpr int PADDING = 16;
+
+int encodedLength(uint32_t value) {
+  if (value < (1u << 8))
+    return 1;
+  if (value < (1u << 16))
+    return 2;
+  if (value < (1u << 24))
+    return 3;
+  return 4;
+}
+
+#if defined(__SSSE3__)
+class ShuffleTable {
+ public:
+  ShuffleTable() {
+    for (int control = 0; control < 256; ++control) {
+      int source = 0;
+      for (int value = 0; value < 4; ++value) {
+        int length = ((control >> (2 * value)) & 3) + 1;
+        for (int byte = 0; byte < 4; ++byte) {
+          masks[control][4 * value + byte] =
+            byte < length ? static_cast<uint8_t>(source + byte) : 0x80;
+        }
+        source += length;
+      }
+      lengths[control] = static_cast<uint8_t>(source);
+    }
+  }
+
+  alignas(16) uint8_t masks[256][16];
+  uint8_t lengths[256];
+};
+
+const ShuffleTable shuffleTable;
+#endif
+
+}  // namespace
+
+void QuestionAdjacency::build(unordered_map<int, Topic> *allTopics) {
+  for (auto &entry : *allTopics)
+    release(&entry.second);
+  clear();
+  offsets.reserve(allTopics->size());
+  counts.reserve(allTopics->size());
+
+  vector<int> questionIds;
+  for (auto &entry : *allTopics) {
+    questionIds.swap(entry.second.getQuestionIds());
+    vector<int>().swap(entry.second.getQuestionIds());
+    std::sort(questionIds.begin(), questionIds.end());
+
+    slots[entry.first] = static_cast<int>(offsets.size());
+    offsets.push_back(bytes.size());
+    counts.push_back(static_cast<uint32_t>(questionIds.size()));
+
+    size_t control = bytes.size();
+    bytes.resize(bytes.size() + (questionIds.size() + 3) / 4, 0);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < questionIds.size(); ++i) {
+      uint32_t delta = static_cast<uint32_t>(questionIds[i]) - previous;
+      previous = static_cast<uint32_t>(questionIds[i]);
+      int length = encodedLength(delta);
+      bytes[control + i / 4] |= (length - 1) << (2 * (i % 4));
+      for (int byte = 0; byte < length; ++byte)
+        bytes.push_back(static_cast<uint8_t>(delta >> (8 * byte)));
+    }
+    questionIds.clear();
+  }
+  bytes.resize(bytes.size() + PADDING, 0);
+  bytes.shrink_to_fit();
+}
+
+void QuestionAdjacency::clear() {
+  slots.clear();
+  offsets.clear();
+  counts.clear();
+  bytes.clear();
+}
+
+bool QuestionAdjacency::decode(int topicId, bool useShuffle,
+                               vector<int> *questionIds) const {
+  auto iter = slots.find(topicId);
+  if (iter == slots.cend())
+    return false;
+
+  uint32_t count = counts[iter->second];
+  const uint8_t *control = bytes.data() + offsets[iter->second];
+  const uint8_t *data = control + (count + 3) / 4;
+  questionIds->resize(count);
+  int *output = questionIds->data();
+
+  uint32_t previous = 0;
+  uint32_t i = 0;
+#if defined(__SSSE3__)
+  if (useShuffle) {
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+      uint8_t lengths = control[i / 4];
+      __m128i values = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)),
+          _mm_load_si128(
+              reinterpret_cast<const __m128i*>(shuffleTable.masks[lengths])));
+      data += shuffleTable.lengths[lengths];
+
+      values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+      values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+      values = _mm_add_epi32(values, carry);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), values);
+      carry = _mm_shuffle_epi32(values, 0xff);
+    }
+    previous = static_cast<uint32_t>(_mm_cvtsi128_si32(carry));
+  }
+#else
+  (void)useShuffle;
+#endif
+  for (; i < count; ++i) {
+    int length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+    uint32_t delta = 0;
+    for (int byte = 0; byte < length; ++byte)
+      delta |= static_cast<uint32_t>(data[byte]) << (8 * byte);
+    data += length;
+    previous += delta;
+    output[i] = static_cast<int>(previous);
+  }
+  return true;
+}
+
+void QuestionAdjacency::release(Topic *topic) {
+  if (decode(topic->getId(), &topic->getQuestionIds()))
+    slots.erase(topic->getId());
+}
+
+size_t QuestionAdjacency::memoryBytes() const {
+  return bytes.capacity() + offsets.capacity() * sizeof(uint64_t) +
+    counts.capacity() * sizeof(uint32_t) +
+    slots.size() * (sizeof(int) * 2 + sizeof(void*));
+}
+
+}  // namespace NearbySolver
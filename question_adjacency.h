@@ -0,0 +1,64 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Compressed topic to question adjacency.
+ */
+
+#ifndef _QUESTION_ADJACENCY_H
+#define _QUESTION_ADJACENCY_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::unordered_map;
+using std::vector;
+
+class QuestionAdjacency;
+
+// Sorted question lists of every topic in one CSR byte array, stored as
+// deltas in the Stream VByte format: a control byte holds the byte lengths
+// of four values, and the values themselves follow in a separate stream, so
+// four of them are decoded at a time with a single byte shuffle.
+class QuestionAdjacency {
+ public:
+  QuestionAdjacency() = default;
+  ~QuestionAdjacency() = default;
+  // Encodes the question lists of every topic and releases the vectors
+  // they were kept in. Lists already encoded are kept.
+  void build(unordered_map<int, Topic> *allTopics);
+  void clear();
+  // Replaces the contents of questionIds with the topic's sorted list, or
+  // returns false if the topic is not held in compressed form.
+  bool decode(int topicId, vector<int> *questionIds) const {
+    return decode(topicId, true, questionIds);
+  }
+  // The same without the SSSE3 shuffle, to compare the two paths.
+  bool decodeScalar(int topicId, vector<int> *questionIds) const {
+    return decode(topicId, false, questionIds);
+  }
+  // Decodes the topic's list back into its vector and drops it from the
+  // compressed form, so that it can be modified again.
+  void release(Topic *topic);
+  size_t memoryBytes() const;
+
+ private:
+  unordered_map<int, int> slots;
+  // Per slot: start of its control bytes in bytes and number of values;
+  // the data bytes follow the control bytes. Offsets are 64-bit since the
+  // byte array of a large graph passes 4 GiB.
+  vector<uint64_t> offsets;
+  vector<uint32_t> counts;
+  vector<uint8_t> bytes;
+
+  bool decode(int topicId, bool useShuffle, vector<int> *questionIds) const;
+};
+
+extern QuestionAdjacency questionAdjacency;
+
+}  // namespace NearbySolver
+
+#endif  // _QUESTION_ADJACENCY_H
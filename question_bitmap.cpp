@@ -0,0 +1,130 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Visited question sets for question queries.
+ */
+
+#include "./question_bitmap.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::vector;
+
+constexpr int QuestionBitmap::CHUNK_ARRAY_LIMIT;
+
+void QuestionBitmap::configure(int maxQuestionId, int64_t expectedTouches) {
+  // A dense bitset pays off while its words are not much more than the
+  // touches expected; otherwise allocating and missing in cache dominate.
+  int64_t numWords = maxQuestionId < 0 ? 0 :
+    (static_cast<int64_t>(maxQuestionId) >> 6) + 1;
+  bool useDense = numWords <= (1 << 14) || numWords <= 8 * expectedTouches;
+
+  clear();
+  if (useDense == dense && numWords == static_cast<int64_t>(words.size()))
+    return;
+  dense = useDense;
+  if (dense) {
+    words.assign(numWords, 0);
+  } else {
+    vector<uint64_t>().swap(words);
+  }
+  dirtyWords.clear();
+}
+
+bool QuestionBitmap::insert(int questionId) {
+  if (!dense || questionId < 0 ||
+      (questionId >> 6) >= static_cast<int>(words.size()))
+    return insertSparse(questionId);
+
+  uint64_t &word = words[questionId >> 6];
+  uint64_t bit = uint64_t(1) << (questionId & 63);
+  if (word & bit)
+    return false;
+  if (word == 0)
+    dirtyWords.push_back(questionId >> 6);
+  word |= bit;
+  return true;
+}
+
+bool QuestionBitmap::contains(int questionId) const {
+  if (!dense || questionId < 0 ||
+      (questionId >> 6) >= static_cast<int>(words.size()))
+    return containsSparse(questionId);
+  return (words[questionId >> 6] >> (questionId & 63)) & 1;
+}
+
+void QuestionBitmap::erase(int questionId) {
+  if (!dense || questionId < 0 ||
+      (questionId >> 6) >= static_cast<int>(words.size())) {
+    eraseSparse(questionId);
+    return;
+  }
+  // The word stays on the dirty list; clearing it again is harmless.
+  words[questionId >> 6] &= ~(uint64_t(1) << (questionId & 63));
+}
+
+void QuestionBitmap::clear() {
+  if (dirtyWords.size() * 8 > words.size()) {
+    std::fill(words.begin(), words.end(), 0);
+  } else {
+    for (int index : dirtyWords)
+      words[index] = 0;
+  }
+  dirtyWords.clear();
+  chunks.clear();
+}
+
+bool QuestionBitmap::insertSparse(int questionId) {
+  Chunk &chunk = chunks[questionId >> 16];
+  uint16_t low = static_cast<uint16_t>(questionId & 0xffff);
+  if (!chunk.words.empty()) {
+    uint64_t &word = chunk.words[low >> 6];
+    uint64_t bit = uint64_t(1) << (low & 63);
+    if (word & bit)
+      return false;
+    word |= bit;
+    return true;
+  }
+
+  auto iter = std::lower_bound(chunk.values.begin(), chunk.values.end(), low);
+  if (iter != chunk.values.end() && *iter == low)
+    return false;
+  chunk.values.insert(iter, low);
+  if (static_cast<int>(chunk.values.size()) > CHUNK_ARRAY_LIMIT) {
+    chunk.words.assign(1 << 10, 0);
+    for (uint16_t value : chunk.values)
+      chunk.words[value >> 6] |= uint64_t(1) << (value & 63);
+    vector<uint16_t>().swap(chunk.values);
+  }
+  return true;
+}
+
+bool QuestionBitmap::containsSparse(int questionId) const {
+  auto chunk = chunks.find(questionId >> 16);
+  if (chunk == chunks.cend())
+    return false;
+  uint16_t low = static_cast<uint16_t>(questionId & 0xffff);
+  if (!chunk->second.words.empty())
+    return (chunk->second.words[low >> 6] >> (low & 63)) & 1;
+  return std::binary_search(chunk->second.values.begin(),
+                            chunk->second.values.end(), low);
+}
+
+void QuestionBitmap::eraseSparse(int questionId) {
+  auto chunk = chunks.find(questionId >> 16);
+  if (chunk == chunks.end())
+    return;
+  uint16_t low = static_cast<uint16_t>(questionId & 0xffff);
+  if (!chunk->second.words.empty()) {
+    chunk->second.words[low >> 6] &= ~(uint64_t(1) << (low & 63));
+    return;
+  }
+  auto iter = std::lower_bound(chunk->second.values.begin(),
+                               chunk->second.values.end(), low);
+  if (iter != chunk->second.values.end() && *iter == low)
+    chunk->second.values.erase(iter);
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Visited question sets for question queries.
+ */
+
+#ifndef _QUESTION_BITMAP_H
+#define _QUESTION_BITMAP_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::unordered_map;
+using std::vector;
+
+class QuestionBitmap;
+
+// Set of question ids touched by a query, replacing a hash probe per link
+// with a bit test. Dense mode is a flat bitset over [0, maxQuestionId] that
+// remembers which words it dirtied, so clearing costs as much as the query
+// touched rather than the size of the universe. When the universe is large
+// next to the expected number of touches, sparse mode keeps roaring-style
+// chunks of 2^16 ids instead, each a sorted array that turns into a bitmap
+// once it fills up.
+class QuestionBitmap {
+ public:
+  QuestionBitmap() = default;
+  ~QuestionBitmap() = default;
+  // Picks the representation for the id range and expected touch count,
+  // and clears the set.
+  void configure(int maxQuestionId, int64_t expectedTouches);
+  // Returns false if the id was already present.
+  bool insert(int questionId);
+  bool contains(int questionId) const;
+  void erase(int questionId);
+  void clear();
+  bool isDense() const { return dense; }
+
+ private:
+  class Chunk {
+   public:
+    // Sorted low halves while small, a 2^16-bit bitmap once words is used.
+    vector<uint16_t> values;
+    vector<uint64_t> words;
+  };
+
+  static constexpr int CHUNK_ARRAY_LIMIT = 4096;
+
+  bool dense = true;
+  vector<uint64_t> words;
+  vector<int> dirtyWords;
+  // Chunks of sparse mode, and ids outside the dense range.
+  unordered_map<int, Chunk> chunks;
+
+  bool insertSparse(int questionId);
+  bool containsSparse(int questionId) const;
+  void eraseSparse(int questionId);
+};
+
+}  // namespace NearbySolver
+
+#endif  // _QUESTION_BITMAP_H
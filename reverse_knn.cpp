@@ -0,0 +1,119 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Reverse k-NN queries over a fixed set of reference points.
+ *
+ * The k-th nearest topic of every reference point is found with the reentrant
+ * k-NN search, one slice of the reference points per thread. The points are
+ * then arranged into an implicit KD-Tree whose subtrees carry the bounding
+ * box of their centers and their largest radius, so a topic only descends
+ * into subtrees containing at least one circle that might enclose it.
+ */
+
+#include "./reverse_knn.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "./balanced_build.h"
+
+namespace NearbySolver {
+
+using std::max;
+using std::numeric_limits;
+using std::thread;
+using std::vector;
+
+void ReverseKNN::build(const vector<vector<double>> &referencePoints, int k) {
+  int numPoints = static_cast<int>(referencePoints.size());
+  circles.assign(numPoints, Circle());
+
+  int numThreads = max(1u, thread::hardware_concurrency());
+  vector<thread> workers;
+  for (int threadIndex = 0; threadIndex < numThreads; ++threadIndex) {
+    workers.emplace_back([&, threadIndex]() {
+      for (int i = threadIndex; i < numPoints; i += numThreads) {
+        Circle &circle = circles[i];
+        circle.index = i;
+        circle.center[0] = referencePoints[i][0];
+        circle.center[1] = referencePoints[i][1];
+
+        ResultHeap results;
+        kdtree.kNNTopics(referencePoints[i], k, &results);
+        if (k > 0 && static_cast<int>(results.size()) == k) {
+          circle.kthResult = results.top();
+        } else {
+          circle.kthResult = DistanceResult(
+              numeric_limits<double>::infinity(), INT_MIN);
+        }
+      }
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+
+  buildBalanced(circles.begin(), circles.end(), 0,
+                [](const Circle &circle, int dimension) {
+                  return circle.center[dimension];
+                });
+  boxes.assign(numPoints, Node::Box::empty());
+  maxRadius.assign(numPoints, 0.0);
+  summarize(0, numPoints);
+}
+
+// Fills in the box and radius of the subtree over circles[begin, end) from
+// those of its children.
+void ReverseKNN::summarize(int begin, int end) {
+  if (begin >= end)
+    return;
+
+  int middle = begin + (end - begin) / 2;
+  summarize(begin, middle);
+  summarize(middle + 1, end);
+
+  boxes[middle].extend(circles[middle].center[0], circles[middle].center[1]);
+  maxRadius[middle] = circles[middle].kthResult.first;
+
+  auto mergeChild = [this, middle](int childBegin, int childEnd) {
+    if (childBegin >= childEnd)
+      return;
+    int child = childBegin + (childEnd - childBegin) / 2;
+    boxes[middle].extend(boxes[child]);
+    maxRadius[middle] = max(maxRadius[middle], maxRadius[child]);
+  };
+  mergeChild(begin, middle);
+  mergeChild(middle + 1, end);
+}
+
+vector<int> ReverseKNN::query(const Topic &topic) const {
+  vector<int> result;
+  query(0, static_cast<int>(circles.size()), topic, &result);
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+void ReverseKNN::query(int begin, int end, const Topic &topic,
+                       vector<int> *result) const {
+  if (begin >= end)
+    return;
+
+  int middle = begin + (end - begin) / 2;
+  if (compareDouble(boxes[middle].distanceTo(topic.getX(), topic.getY()),
+                    maxRadius[middle]))
+    return;
+
+  const Circle &circle = circles[middle];
+  DistanceResult candidate(hypot(topic.getX() - circle.center[0],
+                                 topic.getY() - circle.center[1]),
+                           topic.getId());
+  if (!closerResult(circle.kthResult, candidate))
+    result->push_back(circle.index);
+
+  query(begin, middle, topic, result);
+  query(middle + 1, end, topic, result);
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Reverse k-NN queries over a fixed set of reference points.
+ */
+
+#ifndef _REVERSE_KNN_H
+#define _REVERSE_KNN_H
+
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::vector;
+
+class ReverseKNN;
+
+// Answers "which reference points have this topic in their top-k". Every
+// reference point becomes a circle around itself whose radius is the
+// distance to its k-th nearest topic; a topic is in a point's top-k exactly
+// when it lies inside that circle, so a query is a circle-containment search.
+class ReverseKNN {
+ public:
+  ReverseKNN() = default;
+  ~ReverseKNN() = default;
+  // Computes the k-th nearest topic of every reference point in parallel
+  // and builds the containment index over them.
+  void build(const vector<vector<double>> &referencePoints, int k);
+  // Returns the indices of the reference points that see the topic in their
+  // top-k, in ascending order.
+  vector<int> query(const Topic &topic) const;
+
+ private:
+  class Circle {
+   public:
+    int index = 0;
+    double center[2];
+    // The k-th nearest topic; a topic belongs to the top-k if it orders no
+    // later than it. The radius is infinite when fewer than k topics exist.
+    DistanceResult kthResult;
+  };
+
+  // Circles laid out as an implicit balanced KD-Tree: the median of each
+  // range is its root, split on the axis given by the depth parity.
+  vector<Circle> circles;
+  // Per-subtree bounding box of the centers and largest radius, indexed by
+  // the position of the subtree root in circles.
+  vector<Node::Box> boxes;
+  vector<double> maxRadius;
+
+  void summarize(int begin, int end);
+  void query(int begin, int end, const Topic &topic,
+             vector<int> *result) const;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _REVERSE_KNN_H
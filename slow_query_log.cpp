@@ -0,0 +1,115 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Log of slow queries with the traversal counters of each.
+ *
+ * Each slot is a sequence lock that recorders take turns on by ticket: the
+ * compare-and-swap to an odd sequence number admits one recorder at a time,
+ * and the fields, being relaxed atomics, may be read while it writes them.
+ * A dump that saw the same even sequence number on both sides of its copy,
+ * with an acquire fence before the second look, copied one whole record.
+ * Recording is therefore wait-free, and a dump never holds up a query.
+ *
+ * Every line of a dump starts with the query exactly as read, with all the
+ * digits of its position, so that cutting the comment with its counters
+ * leaves a query line to replay against the same input.
+ */
+
+#include "./slow_query_log.h"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+
+namespace NearbySolver {
+
+using std::atomic_thread_fence;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+
+constexpr int SlowQueryLog::CAPACITY;
+
+thread_local uint64_t nodePrunes = 0;
+thread_local uint64_t questionTouches = 0;
+thread_local int maxDepthVisited = 0;
+SlowQueryLog slowQueries;
+
+void SlowQueryLog::record(const SlowQuery &query) {
+  uint64_t ticket = nextTicket.fetch_add(1, memory_order_relaxed);
+  Slot &slot = slots[ticket % CAPACITY];
+  // An odd sequence number belongs to a recorder still writing a ticket a
+  // ring or more behind, and one past this ticket to a recorder that has
+  // lapped this one; either way this record gives way.
+  uint64_t sequence = slot.sequence.load(memory_order_relaxed);
+  if ((sequence & 1) != 0 || sequence > 2 * ticket ||
+      !slot.sequence.compare_exchange_strong(sequence, 2 * ticket + 1,
+                                             memory_order_relaxed)) {
+    dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  atomic_thread_fence(memory_order_release);
+
+  slot.type.store(query.type, memory_order_relaxed);
+  slot.numResults.store(query.numResults, memory_order_relaxed);
+  slot.x.store(query.x, memory_order_relaxed);
+  slot.y.store(query.y, memory_order_relaxed);
+  slot.time.store(query.time, memory_order_relaxed);
+  slot.seconds.store(query.seconds, memory_order_relaxed);
+  slot.nodesVisited.store(query.nodesVisited, memory_order_relaxed);
+  slot.prunes.store(query.prunes, memory_order_relaxed);
+  slot.questionTouches.store(query.questionTouches, memory_order_relaxed);
+  slot.maxDepth.store(query.maxDepth, memory_order_relaxed);
+  slot.sequence.store(2 * ticket + 2, memory_order_release);
+}
+
+void SlowQueryLog::dump(ostream &out) const {
+  uint64_t end = nextTicket.load(memory_order_acquire);
+  uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+
+  std::streamsize oldPrecision = out.precision();
+  for (uint64_t ticket = begin; ticket < end; ++ticket) {
+    const Slot &slot = slots[ticket % CAPACITY];
+    uint64_t sequence = slot.sequence.load(memory_order_acquire);
+    if (sequence != 2 * ticket + 2)
+      continue;
+
+    SlowQuery query;
+    query.type = slot.type.load(memory_order_relaxed);
+    query.numResults = slot.numResults.load(memory_order_relaxed);
+    query.x = slot.x.load(memory_order_relaxed);
+    query.y = slot.y.load(memory_order_relaxed);
+    query.time = slot.time.load(memory_order_relaxed);
+    query.seconds = slot.seconds.load(memory_order_relaxed);
+    query.nodesVisited = slot.nodesVisited.load(memory_order_relaxed);
+    query.prunes = slot.prunes.load(memory_order_relaxed);
+    query.questionTouches = slot.questionTouches.load(memory_order_relaxed);
+    query.maxDepth = slot.maxDepth.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.sequence.load(memory_order_relaxed) != sequence)
+      continue;
+
+    out.precision(std::numeric_limits<double>::max_digits10);
+    out << query.type << " " << query.numResults << " " << query.x << " "
+        << query.y;
+    if (query.type == 'T' || query.type == 'Q')
+      out << " " << query.time;
+    out.precision(oldPrecision);
+    out << "  # " << query.seconds * 1e3 << " ms, " << query.nodesVisited
+        << " nodes visited, " << query.prunes << " pruned, "
+        << query.questionTouches << " question touches, depth "
+        << query.maxDepth << "\n";
+  }
+}
+
+bool SlowQueryLog::dump(const string &path) const {
+  string temporaryPath = path + ".tmp";
+  {
+    std::ofstream out(temporaryPath);
+    dump(out);
+    if (!out.flush())
+      return false;
+  }
+  return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Log of slow queries with the traversal counters of each.
+ */
+
+#ifndef _SLOW_QUERY_LOG_H
+#define _SLOW_QUERY_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::ostream;
+using std::string;
+
+class SlowQuery;
+class SlowQueryLog;
+
+// Traversal counters of the calling thread beside nodeVisits: subtrees the
+// distance bound ruled out, entries of question lists walked and the
+// deepest level reached. Like nodeVisits they are plain thread_locals, read
+// as differences around a query, except the depth, which is reset.
+extern thread_local uint64_t nodePrunes;
+extern thread_local uint64_t questionTouches;
+extern thread_local int maxDepthVisited;
+
+// A query as it was read, so that it can be replayed, and how it went.
+class SlowQuery {
+ public:
+  char type = 't';
+  int numResults = 0;
+  double x = 0.0, y = 0.0;
+  double time = 0.0;
+  double seconds = 0.0;
+  uint64_t nodesVisited = 0;
+  uint64_t prunes = 0;
+  uint64_t questionTouches = 0;
+  int maxDepth = 0;
+};
+
+// Fixed ring of the latest queries slower than a threshold. Any number of
+// threads may record and dump at once without a lock: a recorder takes a
+// ticket from a shared counter and claims the slot of the ticket with a
+// compare-and-swap on its sequence number, which stays odd while the slot
+// is written. A dump copies every slot whose sequence number matches its
+// ticket before and after the copy, so it skips records being written or
+// already overwritten. A record whose slot is still being written by a
+// recorder a whole ring behind is dropped and counted.
+class SlowQueryLog {
+ public:
+  static constexpr int CAPACITY = 1024;
+
+  SlowQueryLog() = default;
+  SlowQueryLog(const SlowQueryLog&) = delete;
+  SlowQueryLog& operator= (const SlowQueryLog&) = delete;
+
+  // Queries slower than the threshold are recorded; none are when it is
+  // not positive, which is the default.
+  void setThreshold(double seconds) {
+    thresholdSeconds.store(seconds, std::memory_order_relaxed);
+  }
+  bool isSlow(double seconds) const {
+    double threshold = thresholdSeconds.load(std::memory_order_relaxed);
+    return threshold > 0.0 && seconds > threshold;
+  }
+  void record(const SlowQuery &query);
+  uint64_t getDropped() const { return dropped.load(); }
+  // Oldest first, one query per line in the input format followed by its
+  // counters as a comment.
+  void dump(ostream &out) const;
+  // Through a temporary file renamed over the path.
+  bool dump(const string &path) const;
+
+ private:
+  class Slot {
+   public:
+    // Twice the ticket plus one while written, twice the next ticket once
+    // complete; zero before the first record.
+    atomic<uint64_t> sequence{0};
+    atomic<char> type{'t'};
+    atomic<int> numResults{0};
+    atomic<double> x{0.0}, y{0.0};
+    atomic<double> time{0.0};
+    atomic<double> seconds{0.0};
+    atomic<uint64_t> nodesVisited{0};
+    atomic<uint64_t> prunes{0};
+    atomic<uint64_t> questionTouches{0};
+    atomic<int> maxDepth{0};
+  };
+
+  atomic<double> thresholdSeconds{0.0};
+  atomic<uint64_t> nextTicket{0};
+  atomic<uint64_t> dropped{0};
+  Slot slots[CAPACITY];
+};
+
+extern SlowQueryLog slowQueries;
+
+}  // namespace NearbySolver
+
+#endif  // _SLOW_QUERY_LOG_H
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Snapshots of the index and recovery from snapshot plus update log.
+ *
+ * Snapshot layout, native endian: magic, version, first log segment, topic
+ * count, then per topic its id, x, y, creation and expiry times, question
+ * count and question ids, then the question count and per question its id
+ * and topic count. Version 1 lacks the times.
+ *
+ * The update log is split into numbered segments. Compaction closes the
+ * current segment, copies the index in memory, and hands the copy to a
+ * background thread which writes the snapshot next to the old one, renames
+ * it into place and only then deletes the segments it covers. A crash at any
+ * point leaves either the old snapshot with all of its segments or the new
+ * snapshot with the segments written after it.
+ */
+
+#include "./snapshot.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "./probes.h"
+#include "./question_adjacency.h"
+
+namespace NearbySolver {
+
+using std::string;
+using std::vector;
+
+constexpr uint32_t Snapshot::MAGIC;
+constexpr uint32_t Snapshot::VERSION;
+
+namespace {
+
+// Numbers of the "log.N" segments in a directory, in ascending order.
+vector<int> listSegments(const string &directory) {
+  vector<int> segments;
+  DIR *handle = opendir(directory.c_str());
+  if (handle == nullptr)
+    return segments;
+  while (const dirent *entry = readdir(handle)) {
+    if (strncmp(entry->d_name, "log.", 4) != 0)
+      continue;
+    char *end = nullptr;
+    long number = strtol(entry->d_name + 4, &end, 10);
+    if (end != entry->d_name + 4 && *end == '\0')
+      segments.push_back(static_cast<int>(number));
+  }
+  closedir(handle);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+bool syncDirectory(const string &directory) {
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  bool synced = fsync(fd) == 0;
+  ::close(fd);
+  return synced;
+}
+
+class SnapshotWriter {
+ public:
+  template <typename T>
+  void put(const T &value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  string data;
+};
+
+class SnapshotReader {
+ public:
+  SnapshotReader(const char *data, size_t size) : data(data), size(size) {}
+  template <typename T>
+  bool get(T *value) {
+    if (size - offset < sizeof(T))
+      return false;
+    memcpy(value, data + offset, sizeof(T));
+    offset += sizeof(T);
+    return true;
+  }
+
+ private:
+  const char *data;
+  size_t size;
+  size_t offset = 0;
+};
+
+}  // namespace
+
+Snapshot Snapshot::capture(int firstSegment) {
+  Snapshot snapshot;
+  snapshot.firstSegment = firstSegment;
+  snapshot.topicList.reserve(topics.size());
+  for (const auto &entry : topics) {
+    snapshot.topicList.push_back(entry.second);
+    snapshot.topicList.back().getQuestionIds() = questionIdsOf(entry.first);
+  }
+  snapshot.questionList.reserve(questions.size());
+  for (const auto &entry : questions)
+    snapshot.questionList.push_back(entry.second);
+  return snapshot;
+}
+
+bool Snapshot::write(const string &path) const {
+  SnapshotWriter writer;
+  writer.put(MAGIC);
+  writer.put(VERSION);
+  writer.put(static_cast<int32_t>(firstSegment));
+  writer.put(static_cast<int32_t>(topicList.size()));
+  for (const Topic &topic : topicList) {
+    writer.put(static_cast<int32_t>(topic.getId()));
+    writer.put(topic.getX());
+    writer.put(topic.getY());
+    writer.put(topic.getCreatedAt());
+    writer.put(topic.getExpiresAt());
+    writer.put(static_cast<int32_t>(topic.getQuestionIds().size()));
+    for (int questionId : topic.getQuestionIds())
+      writer.put(static_cast<int32_t>(questionId));
+  }
+  writer.put(static_cast<int32_t>(questionList.size()));
+  for (const Question &question : questionList) {
+    writer.put(static_cast<int32_t>(question.getId()));
+    writer.put(static_cast<int32_t>(question.getTopicCount()));
+  }
+
+  string temporaryPath = path + ".tmp";
+  int fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  size_t written = 0;
+  while (written < writer.data.size()) {
+    ssize_t result = ::write(fd, writer.data.data() + written,
+                             writer.data.size() - written);
+    if (result < 0) {
+      ::close(fd);
+      return false;
+    }
+    written += result;
+  }
+  bool synced = fsync(fd) == 0;
+  ::close(fd);
+  if (!synced || rename(temporaryPath.c_str(), path.c_str()) != 0)
+    return false;
+
+  size_t slash = path.find_last_of('/');
+  return syncDirectory(slash == string::npos ? "." : path.substr(0, slash));
+}
+
+bool Snapshot::read(const string &path) {
+  topicList.clear();
+  questionList.clear();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void *mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+
+  SnapshotReader reader(static_cast<const char*>(mapping), status.st_size);
+  uint32_t magic = 0, version = 0;
+  int32_t segmentNumber = -1, numTopics = 0, numQuestions = 0;
+  bool valid = reader.get(&magic) && magic == MAGIC &&
+    reader.get(&version) && (version == 1 || version == VERSION) &&
+    reader.get(&segmentNumber) && segmentNumber >= 0 &&
+    reader.get(&numTopics) && numTopics >= 0;
+
+  for (int32_t i = 0; valid && i < numTopics; ++i) {
+    int32_t topicId, numLinks;
+    double x, y;
+    double createdAt = -std::numeric_limits<double>::infinity();
+    double expiresAt = std::numeric_limits<double>::infinity();
+    valid = reader.get(&topicId) && reader.get(&x) && reader.get(&y) &&
+      (version == 1 || (reader.get(&createdAt) && reader.get(&expiresAt))) &&
+      reader.get(&numLinks) && numLinks >= 0;
+    if (!valid)
+      break;
+    topicList.emplace_back(topicId, x, y);
+    topicList.back().setLifetime(createdAt, expiresAt);
+    vector<int> &questionIds = topicList.back().getQuestionIds();
+    for (int32_t j = 0; valid && j < numLinks; ++j) {
+      int32_t questionId;
+      valid = reader.get(&questionId);
+      questionIds.push_back(questionId);
+    }
+  }
+
+  valid = valid && reader.get(&numQuestions) && numQuestions >= 0;
+  for (int32_t i = 0; valid && i < numQuestions; ++i) {
+    int32_t questionId, topicCount;
+    valid = reader.get(&questionId) && reader.get(&topicCount);
+    if (valid)
+      questionList.emplace_back(questionId, topicCount);
+  }
+
+  munmap(mapping, status.st_size);
+  if (!valid) {
+    topicList.clear();
+    questionList.clear();
+    return false;
+  }
+  firstSegment = segmentNumber;
+  return true;
+}
+
+void Snapshot::apply() const {
+  for (const Topic &topic : topicList)
+    kdtree.insert(topics[topic.getId()] = topic);
+  for (const Question &question : questionList) {
+    questions[question.getId()] = question;
+    maxQuestionId = std::max(maxQuestionId, question.getId());
+  }
+}
+
+DurableIndex::~DurableIndex() {
+  waitForCompaction();
+}
+
+string DurableIndex::segmentPath(int number) const {
+  return directory + "/log." + std::to_string(number);
+}
+
+bool DurableIndex::open(const string &path) {
+  directory = path;
+  mkdir(directory.c_str(), 0755);
+
+  // Without a snapshot every segment is replayed. A snapshot that cannot
+  // be read fails the open instead: the segments it covers are gone, so
+  // replaying the rest would silently lose updates.
+  int firstSegment = 0;
+  string snapshotPath = directory + "/snapshot";
+  struct stat status;
+  if (stat(snapshotPath.c_str(), &status) == 0) {
+    Snapshot snapshot;
+    bool valid = snapshot.read(snapshotPath);
+    NEARBY_PROBE1(snapshot__load, valid ? snapshot.getFirstSegment() : -1);
+    if (!valid)
+      return false;
+    snapshot.apply();
+    firstSegment = snapshot.getFirstSegment();
+  }
+  segment = firstSegment;
+  recordsSinceSnapshot = 0;
+  for (int number : listSegments(directory)) {
+    if (number < firstSegment)
+      continue;
+    int replayed = UpdateLog::replay(
+        segmentPath(number), [](const UpdateRecord &record) {
+          record.apply();
+        });
+    recordsSinceSnapshot += std::max(replayed, 0);
+    segment = number + 1;
+  }
+  // The recovered topics get the same compressed adjacency and jump table
+  // as a fresh load.
+  questionAdjacency.build(&topics);
+  kdtree.buildJumpTable();
+  return log.open(segmentPath(segment));
+}
+
+bool DurableIndex::append(const UpdateRecord &record) {
+  if (!log.append(record))
+    return false;
+  record.apply();
+  if (++recordsSinceSnapshot >= compactionThreshold)
+    compact();
+  return true;
+}
+
+bool DurableIndex::addTopic(const Topic &topic) {
+  UpdateRecord record;
+  record.type = UPDATE_ADD_TOPIC;
+  record.topicId = topic.getId();
+  record.x = topic.getX();
+  record.y = topic.getY();
+  // Only a lifetime other than the default takes the longer record.
+  if (topic.getCreatedAt() != record.createdAt ||
+      topic.getExpiresAt() != record.expiresAt) {
+    record.type = UPDATE_ADD_TIMED_TOPIC;
+    record.createdAt = topic.getCreatedAt();
+    record.expiresAt = topic.getExpiresAt();
+  }
+  return append(record);
+}
+
+bool DurableIndex::moveTopic(int topicId, double x, double y) {
+  UpdateRecord record;
+  record.type = UPDATE_MOVE_TOPIC;
+  record.topicId = topicId;
+  record.x = x;
+  record.y = y;
+  return append(record);
+}
+
+bool DurableIndex::linkQuestion(int questionId, int topicId) {
+  UpdateRecord record;
+  record.type = UPDATE_LINK_QUESTION;
+  record.topicId = topicId;
+  record.questionId = questionId;
+  return append(record);
+}
+
+bool DurableIndex::setTopicLifetime(int topicId, double createdAt,
+                                    double expiresAt) {
+  UpdateRecord record;
+  record.type = UPDATE_SET_LIFETIME;
+  record.topicId = topicId;
+  record.x = createdAt;
+  record.y = expiresAt;
+  return append(record);
+}
+
+bool DurableIndex::compact() {
+  if (compacting)
+    return false;
+  waitForCompaction();
+
+  // Everything up to here is covered by the snapshot; later updates go to
+  // a fresh segment, which must not start with the rest of a record the
+  // current one could not take.
+  if (!log.rotate(segmentPath(segment + 1)))
+    return false;
+  ++segment;
+  recordsSinceSnapshot = 0;
+
+  compacting = true;
+  compactor = thread([this](Snapshot snapshot, int firstSegment) {
+    NEARBY_PROBE1(snapshot__start, firstSegment);
+    bool written = snapshot.write(directory + "/snapshot");
+    if (written) {
+      for (int number : listSegments(directory)) {
+        if (number < firstSegment)
+          unlink(segmentPath(number).c_str());
+      }
+    }
+    NEARBY_PROBE2(snapshot__end, firstSegment, written);
+    compacting = false;
+  }, Snapshot::capture(segment), segment);
+  return true;
+}
+
+void DurableIndex::waitForCompaction() {
+  if (compactor.joinable())
+    compactor.join();
+}
+
+}  // namespace NearbySolver
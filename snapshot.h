@@ -0,0 +1,97 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Snapshots of the index and recovery from snapshot plus update log.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./nearby.h"
+#include "./update_log.h"
+
+namespace NearbySolver {
+
+using std::atomic;
+using std::string;
+using std::thread;
+using std::vector;
+
+class Snapshot;
+class DurableIndex;
+
+// Point-in-time copy of the topics and questions. Log segments numbered
+// from firstSegment on hold the updates made after it was taken.
+class Snapshot {
+ public:
+  Snapshot() = default;
+  ~Snapshot() = default;
+  // Copies the current global topics and questions.
+  static Snapshot capture(int firstSegment);
+  bool write(const string &path) const;
+  // Reads a file written by write through mmap; returns false, with
+  // nothing to apply, if it cannot be read whole.
+  bool read(const string &path);
+  // Inserts the topics and questions into the global index and KD-Tree.
+  void apply() const;
+  // First log segment to replay after applying the snapshot.
+  int getFirstSegment() const { return firstSegment; }
+
+  static constexpr uint32_t MAGIC = 0x50414e53;  // "SNAP"
+  // Version 1 snapshots, from before topic lifetimes, are still read.
+  static constexpr uint32_t VERSION = 2;
+
+ private:
+  int firstSegment = 0;
+  vector<Topic> topicList;
+  vector<Question> questionList;
+};
+
+// Applies online updates to the global index and records them in the update
+// log of a directory. On open the latest snapshot is loaded and only the log
+// segments written after it are replayed; once enough records accumulate, a
+// new snapshot is written on a background thread and the covered segments
+// are deleted, so recovery time stays flat as the history grows.
+class DurableIndex {
+ public:
+  DurableIndex() = default;
+  ~DurableIndex();
+  DurableIndex(const DurableIndex&) = delete;
+  DurableIndex& operator= (const DurableIndex&) = delete;
+
+  // Returns false if the directory holds a snapshot that cannot be read,
+  // leaving the index as it was.
+  bool open(const string &directory);
+  // Each update is logged and then applied. One that cannot be logged is
+  // not applied either, and false is returned.
+  bool addTopic(const Topic &topic);
+  bool moveTopic(int topicId, double x, double y);
+  bool linkQuestion(int questionId, int topicId);
+  bool setTopicLifetime(int topicId, double createdAt, double expiresAt);
+  bool commit() { return log.commit(); }
+  // Starts a background snapshot of the current state; returns false if
+  // one is still running or the log cannot move on to a new segment.
+  bool compact();
+  void waitForCompaction();
+  void setCompactionThreshold(int records) { compactionThreshold = records; }
+
+ private:
+  string directory;
+  UpdateLog log;
+  int segment = 0;
+  int recordsSinceSnapshot = 0;
+  int compactionThreshold = 1 << 20;
+  thread compactor;
+  atomic<bool> compacting{false};
+
+  string segmentPath(int number) const;
+  bool append(const UpdateRecord &record);
+};
+
+}  // namespace NearbySolver
+
+#endif  // _SNAPSHOT_H
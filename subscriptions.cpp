@@ -0,0 +1,200 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Standing k-NN topic subscriptions for the Nearby solver.
+ *
+ * Each subscription is seeded with a regular k-NN search and afterwards only
+ * updated incrementally. A newly inserted topic can only enter the top-k of a
+ * subscription whose query point lies within its current k-th distance of the
+ * topic, so the subscription tree is searched for exactly those points.
+ */
+
+#include "./subscriptions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace NearbySolver {
+
+using std::max;
+using std::numeric_limits;
+using std::vector;
+
+SubscriptionIndex subscriptions;
+
+double Subscription::radius() const {
+  if (static_cast<int>(results.size()) < numResults)
+    return numeric_limits<double>::infinity();
+  return results.empty() ? 0.0 : results.back().first;
+}
+
+vector<int> Subscription::getTopicIds() const {
+  vector<int> topicIds;
+  topicIds.reserve(results.size());
+  for (const auto &result : results)
+    topicIds.push_back(result.second);
+  return topicIds;
+}
+
+bool Subscription::offer(const Topic &topic) {
+  if (numResults <= 0)
+    return false;
+
+  DistanceResult result(hypot(topic.getX() - position[0],
+                              topic.getY() - position[1]),
+                        topic.getId());
+  if (static_cast<int>(results.size()) >= numResults &&
+      !closerResult(result, results.back()))
+    return false;
+
+  results.insert(std::upper_bound(results.begin(), results.end(), result,
+                                  closerResult),
+                 result);
+  if (static_cast<int>(results.size()) > numResults)
+    results.pop_back();
+  return true;
+}
+
+bool Subscription::contains(int topicId) const {
+  for (const auto &result : results) {
+    if (result.second == topicId)
+      return true;
+  }
+  return false;
+}
+
+// Fills the top-k with a regular search over the topics in the KD-Tree. The
+// search keeps its results in a local heap, so seeding from inside a query
+// leaves that query's globals alone, and it ignores topic lifetimes just like
+// offer() does.
+void Subscription::seed() {
+  results.clear();
+  if (numResults <= 0)
+    return;
+
+  ResultHeap heap;
+  kdtree.kNNTopics(position, numResults, &heap);
+  results.resize(heap.size());
+  for (auto result = results.rbegin(); result != results.rend(); ++result) {
+    *result = heap.top();
+    heap.pop();
+  }
+}
+
+SubscriptionNode::SubscriptionNode(const Subscription &subscription) :
+  subscriptionId(subscription.getId()), box(Node::Box::empty()),
+  maxRadius(subscription.radius()) {
+  box.extend(subscription.getPosition()[0], subscription.getPosition()[1]);
+}
+
+void SubscriptionIndex::freeNodes(SubscriptionNode *currentNode) {
+  if (currentNode == nullptr)
+    return;
+
+  freeNodes(currentNode->left);
+  freeNodes(currentNode->right);
+  delete currentNode;
+}
+
+SubscriptionIndex::~SubscriptionIndex() {
+  freeNodes(root);
+}
+
+int SubscriptionIndex::subscribe(int k, const vector<double> &position) {
+  Subscription subscription(nextId++, k, position);
+  subscription.seed();
+  root = insert(root, false, subscription);
+  return (subscriptions[subscription.getId()] = subscription).getId();
+}
+
+SubscriptionNode* SubscriptionIndex::insert(
+    SubscriptionNode *currentNode, int depth,
+    const Subscription &subscription) {
+  if (currentNode == nullptr)
+    return new SubscriptionNode(subscription);
+
+  const vector<double> &position = subscription.getPosition();
+  currentNode->box.extend(position[0], position[1]);
+  currentNode->maxRadius = max(currentNode->maxRadius, subscription.radius());
+
+  int depthParity = depth & 1;
+  const vector<double> &nodePosition =
+    subscriptions[currentNode->subscriptionId].getPosition();
+  if (position[depthParity] < nodePosition[depthParity]) {
+    currentNode->left = insert(currentNode->left, depth + 1, subscription);
+  } else {
+    currentNode->right = insert(currentNode->right, depth + 1, subscription);
+  }
+  return currentNode;
+}
+
+vector<int> SubscriptionIndex::notifyInsert(const Topic &topic) {
+  vector<int> changed;
+  notifyInsert(root, topic, &changed);
+  return changed;
+}
+
+void SubscriptionIndex::notifyInsert(
+    SubscriptionNode *currentNode, const Topic &topic, vector<int> *changed) {
+  if (currentNode == nullptr)
+    return;
+
+  // Skip subtrees whose subscriptions are all too far away for the topic
+  // to displace their current k-th result.
+  if (compareDouble(currentNode->box.distanceTo(topic.getX(), topic.getY()),
+                    currentNode->maxRadius))
+    return;
+
+  Subscription &subscription = subscriptions[currentNode->subscriptionId];
+  if (subscription.offer(topic))
+    changed->push_back(subscription.getId());
+
+  notifyInsert(currentNode->left, topic, changed);
+  notifyInsert(currentNode->right, topic, changed);
+
+  // Radii only shrink on insert, so tighten the bound on the way back up.
+  updateRadius(currentNode);
+}
+
+vector<int> SubscriptionIndex::notifyRemove(const Topic &topic) {
+  vector<int> changed;
+  notifyRemove(root, topic, &changed);
+  return changed;
+}
+
+void SubscriptionIndex::notifyRemove(
+    SubscriptionNode *currentNode, const Topic &topic, vector<int> *changed) {
+  if (currentNode == nullptr)
+    return;
+
+  // Only subscriptions whose circle covers the topic can hold it.
+  if (compareDouble(currentNode->box.distanceTo(topic.getX(), topic.getY()),
+                    currentNode->maxRadius))
+    return;
+
+  Subscription &subscription = subscriptions[currentNode->subscriptionId];
+  if (subscription.contains(topic.getId())) {
+    subscription.seed();
+    changed->push_back(subscription.getId());
+  }
+
+  notifyRemove(currentNode->left, topic, changed);
+  notifyRemove(currentNode->right, topic, changed);
+
+  // Seeding again may grow a radius, which every ancestor on this path
+  // picks up here.
+  updateRadius(currentNode);
+}
+
+void SubscriptionIndex::updateRadius(SubscriptionNode *currentNode) {
+  currentNode->maxRadius = subscriptions[currentNode->subscriptionId].radius();
+  if (currentNode->left != nullptr)
+    currentNode->maxRadius =
+      max(currentNode->maxRadius, currentNode->left->maxRadius);
+  if (currentNode->right != nullptr)
+    currentNode->maxRadius =
+      max(currentNode->maxRadius, currentNode->right->maxRadius);
+}
+
+}  // namespace NearbySolver
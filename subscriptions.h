@@ -0,0 +1,106 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Standing k-NN topic subscriptions for the Nearby solver.
+ */
+
+#ifndef _SUBSCRIPTIONS_H
+#define _SUBSCRIPTIONS_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::unordered_map;
+using std::vector;
+
+class Subscription;
+class SubscriptionNode;
+class SubscriptionIndex;
+
+// A registered (point, k) query whose top-k topics are kept current as
+// topics are inserted.
+class Subscription {
+ public:
+  Subscription() = default;
+  ~Subscription() = default;
+  Subscription(int id, int numResults, const vector<double> &position) :
+    id(id), numResults(numResults), position(position) {}
+  int getId() const { return id; }
+  const vector<double>& getPosition() const { return position; }
+  // Distance to the current k-th topic, or infinity while fewer than k
+  // topics have been seen.
+  double radius() const;
+  vector<int> getTopicIds() const;
+
+ private:
+  int id = 0;
+  int numResults = 0;
+  vector<double> position = {0.0, 0.0};
+  // (distance, topic id) pairs in the same order as the topic set.
+  vector<DistanceResult> results;
+
+  bool offer(const Topic &topic);
+  bool contains(int topicId) const;
+  void seed();
+
+  friend class SubscriptionIndex;
+};
+
+class SubscriptionNode {
+ public:
+  SubscriptionNode() = default;
+  ~SubscriptionNode() = default;
+  explicit SubscriptionNode(const Subscription &subscription);
+
+ private:
+  int subscriptionId = 0;
+  SubscriptionNode *left = nullptr;
+  SubscriptionNode *right = nullptr;
+  // Bounding box of every subscription point in this subtree.
+  Node::Box box;
+  // Upper bound on the radius of every subscription in this subtree.
+  double maxRadius = 0.0;
+
+  friend class SubscriptionIndex;
+};
+
+// Subscriptions are kept in their own KD-Tree keyed on the query point and
+// augmented with the largest k-th distance radius of each subtree, so a topic
+// insert is a reverse range query that only visits subtrees it can affect.
+class SubscriptionIndex {
+ public:
+  SubscriptionIndex() = default;
+  ~SubscriptionIndex();
+  int subscribe(int numResults, const vector<double> &position);
+  const Subscription& getSubscription(int id) const {
+    return subscriptions.at(id);
+  }
+  // Return the ids of subscriptions whose top-k changed. A removal must be
+  // reported after the topic has left the KD-Tree, as the subscriptions
+  // that held it are seeded again from the tree.
+  vector<int> notifyInsert(const Topic &topic);
+  vector<int> notifyRemove(const Topic &topic);
+
+ private:
+  int nextId = 0;
+  unordered_map<int, Subscription> subscriptions;
+  SubscriptionNode *root = nullptr;
+
+  SubscriptionNode* insert(SubscriptionNode *currentNode, int depth,
+                           const Subscription &subscription);
+  void notifyInsert(SubscriptionNode *currentNode, const Topic &topic,
+                    vector<int> *changed);
+  void notifyRemove(SubscriptionNode *currentNode, const Topic &topic,
+                    vector<int> *changed);
+  void updateRadius(SubscriptionNode *currentNode);
+  void freeNodes(SubscriptionNode *currentNode);
+};
+
+extern SubscriptionIndex subscriptions;
+
+}  // namespace NearbySolver
+
+#endif  // _SUBSCRIPTIONS_H
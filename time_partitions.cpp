@@ -0,0 +1,225 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Time-partitioned topic index with whole-partition expiry.
+ *
+ * Removing an expired topic from a KD-Tree costs a descent plus the repair
+ * of every summary above it, and doing that for a whole hour of topics is
+ * far more work than the topics took to insert. Here the partitions of a
+ * bucket are discarded together: sealed items are plain data, so dropping a
+ * partition is a single deallocation no matter how many topics it holds.
+ * The open bucket's tree does have a node per topic, so it is freed on
+ * another thread once its bucket is sealed or expires.
+ *
+ * A query visits the open tree and then the sealed partitions in order of
+ * the distance to their bounding boxes, all feeding one result heap or
+ * question ranking, and skips every partition whose box is farther than the
+ * current k-th result.
+ */
+
+#include "./time_partitions.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "./balanced_build.h"
+#include "./probes.h"
+
+namespace NearbySolver {
+
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::vector;
+
+TimePartitionedIndex::TimePartitionedIndex(double bucketWidth) :
+  bucketWidth(bucketWidth), openTree(new KDTree()) {}
+
+void TimePartitionedIndex::insert(const Topic &topic, double time) {
+  double bucketStart = floor(time / bucketWidth) * bucketWidth;
+  if (openItems.empty()) {
+    openStart = max(openStart, bucketStart);
+  } else if (bucketStart > openStart) {
+    seal();
+    openStart = bucketStart;
+  }
+
+  Item item;
+  item.topicId = topic.getId();
+  item.coordinates[0] = topic.getX();
+  item.coordinates[1] = topic.getY();
+  item.createdAt = topic.getCreatedAt();
+  item.expiresAt = topic.getExpiresAt();
+  openItems.push_back(item);
+  openTree->insert(topic);
+}
+
+void TimePartitionedIndex::seal() {
+  NEARBY_PROBE1(partition__seal, openItems.size());
+  Partition partition;
+  partition.bucketStart = openStart;
+  partition.items.swap(openItems);
+  partition.box = Node::Box::empty();
+  partition.minCreatedAt = numeric_limits<double>::infinity();
+  partition.maxExpiresAt = -numeric_limits<double>::infinity();
+  for (const Item &item : partition.items) {
+    partition.box.extend(item.coordinates[0], item.coordinates[1]);
+    partition.minCreatedAt = min(partition.minCreatedAt, item.createdAt);
+    partition.maxExpiresAt = max(partition.maxExpiresAt, item.expiresAt);
+  }
+  buildBalanced(partition.items.begin(), partition.items.end(), 0,
+                [](const Item &item, int dimension) {
+                  return item.coordinates[dimension];
+                });
+  sealed.push_back(std::move(partition));
+  replaceOpenTree();
+}
+
+void TimePartitionedIndex::expireBefore(double time) {
+  while (!sealed.empty() && sealed.front().bucketStart + bucketWidth <= time)
+    sealed.pop_front();
+  if (!openItems.empty() && openStart + bucketWidth <= time) {
+    openItems.clear();
+    replaceOpenTree();
+  }
+}
+
+// Swaps in an empty open tree and frees the old one on another thread. The
+// index is not shared with searches while it is updated, so nothing else
+// can hold the old tree.
+void TimePartitionedIndex::replaceOpenTree() {
+  pendingFrees.erase(
+    std::remove_if(pendingFrees.begin(), pendingFrees.end(),
+                   [](const future<void> &pendingFree) {
+                     return pendingFree.wait_for(std::chrono::seconds(0)) ==
+                       std::future_status::ready;
+                   }),
+    pendingFrees.end());
+  KDTree *oldTree = openTree.release();
+  openTree.reset(new KDTree());
+  pendingFrees.push_back(
+    std::async(std::launch::async, [oldTree]() { delete oldTree; }));
+}
+
+int TimePartitionedIndex::size() const {
+  int total = static_cast<int>(openItems.size());
+  for (const Partition &partition : sealed)
+    total += static_cast<int>(partition.items.size());
+  return total;
+}
+
+int TimePartitionedIndex::numPartitions() const {
+  return static_cast<int>(sealed.size()) + !openItems.empty();
+}
+
+vector<const TimePartitionedIndex::Partition*>
+TimePartitionedIndex::nearestFirst(const vector<double> &position) const {
+  vector<const Partition*> order;
+  for (const Partition &partition : sealed)
+    order.push_back(&partition);
+  std::sort(order.begin(), order.end(),
+            [&position](const Partition *partition1,
+                        const Partition *partition2) {
+              return partition1->box.distanceTo(position) <
+                partition2->box.distanceTo(position);
+            });
+  return order;
+}
+
+void TimePartitionedIndex::kNNTopics(const vector<double> &position, int k,
+                                     ResultHeap *results, double time) const {
+  if (k <= 0)
+    return;
+
+  openTree->kNNTopics(position, k, results, time);
+  for (const Partition *partition : nearestFirst(position)) {
+    if (static_cast<int>(results->size()) >= k &&
+        partition->box.distanceTo(position) >= results->top().first)
+      break;
+    if (partition->deadAt(time))
+      continue;
+    partition->kNNTopics(0, static_cast<int>(partition->items.size()), 0,
+                         position, k, time, results);
+  }
+}
+
+vector<int> TimePartitionedIndex::kNNQuestions(const vector<double> &position,
+                                               int k, double time) const {
+  QueryArena::Scope scope(&queryArena());
+  GroupQuestions results(k);
+  if (k <= 0)
+    return results.getQuestionIds();
+
+  openTree->kNNQuestions(position, &results, time);
+  for (const Partition *partition : nearestFirst(position)) {
+    if (compareDouble(partition->box.distanceTo(position), results.bound()))
+      break;
+    if (partition->deadAt(time))
+      continue;
+    partition->kNNQuestions(0, static_cast<int>(partition->items.size()), 0,
+                            position, time, &results);
+  }
+  return results.getQuestionIds();
+}
+
+void TimePartitionedIndex::Partition::kNNTopics(
+    int begin, int end, int depth, const vector<double> &position, int k,
+    double time, ResultHeap *results) const {
+  if (begin >= end)
+    return;
+
+  int depthParity = depth & 1;
+  int middle = begin + (end - begin) / 2;
+  const Item &item = items[middle];
+  if (item.isLiveAt(time)) {
+    results->emplace(hypot(position[0] - item.coordinates[0],
+                           position[1] - item.coordinates[1]), item.topicId);
+    if (static_cast<int>(results->size()) > k)
+      results->pop();
+  }
+
+  double offset = position[depthParity] - item.coordinates[depthParity];
+  if (offset < 0) {
+    kNNTopics(begin, middle, depth + 1, position, k, time, results);
+    if (static_cast<int>(results->size()) < k ||
+        -offset < results->top().first)
+      kNNTopics(middle + 1, end, depth + 1, position, k, time, results);
+  } else {
+    kNNTopics(middle + 1, end, depth + 1, position, k, time, results);
+    if (static_cast<int>(results->size()) < k ||
+        offset < results->top().first)
+      kNNTopics(begin, middle, depth + 1, position, k, time, results);
+  }
+}
+
+void TimePartitionedIndex::Partition::kNNQuestions(
+    int begin, int end, int depth, const vector<double> &position,
+    double time, GroupQuestions *results) const {
+  if (begin >= end)
+    return;
+
+  int depthParity = depth & 1;
+  int middle = begin + (end - begin) / 2;
+  const Item &item = items[middle];
+  if (item.isLiveAt(time)) {
+    double distance = hypot(position[0] - item.coordinates[0],
+                            position[1] - item.coordinates[1]);
+    for (int questionId : questionIdsOf(item.topicId))
+      results->offer(questionId, distance);
+  }
+
+  double offset = position[depthParity] - item.coordinates[depthParity];
+  if (offset < 0) {
+    kNNQuestions(begin, middle, depth + 1, position, time, results);
+    if (!compareDouble(-offset, results->bound()))
+      kNNQuestions(middle + 1, end, depth + 1, position, time, results);
+  } else {
+    kNNQuestions(middle + 1, end, depth + 1, position, time, results);
+    if (!compareDouble(offset, results->bound()))
+      kNNQuestions(begin, middle, depth + 1, position, time, results);
+  }
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Time-partitioned topic index with whole-partition expiry.
+ */
+
+#ifndef _TIME_PARTITIONS_H
+#define _TIME_PARTITIONS_H
+
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "./group_questions.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::deque;
+using std::future;
+using std::unique_ptr;
+using std::vector;
+
+class TimePartitionedIndex;
+
+// Topics with a time to live, grouped into fixed-width time buckets. The
+// newest bucket is open and takes inserts into a regular KD-Tree; when a
+// later bucket starts it is sealed into a static, balanced tree laid out in
+// one array. Expiring a bucket drops its partition as a whole instead of
+// removing its topics one by one. Queries walk every partition held, nearest
+// first, sharing one set of results so that the k-th result found in one
+// partition prunes all the others. Within a bucket, topics are filtered by
+// their own lifetimes as the KD-Tree searches do.
+class TimePartitionedIndex {
+ public:
+  explicit TimePartitionedIndex(double bucketWidth = 3600.0);
+  ~TimePartitionedIndex() = default;
+  // Adds a topic created at the time. A topic older than the open bucket
+  // joins it anyway and expires with it.
+  void insert(const Topic &topic, double time);
+  // Drops every partition whose bucket ends at or before the time.
+  void expireBefore(double time);
+  // Same contracts as the reentrant KDTree searches, including that only
+  // topics live at the query time are found.
+  void kNNTopics(const vector<double> &position, int k, ResultHeap *results,
+                 double time = ANY_TIME) const;
+  vector<int> kNNQuestions(const vector<double> &position, int k,
+                           double time = ANY_TIME) const;
+  int size() const;
+  int numPartitions() const;
+
+ private:
+  class Item {
+   public:
+    int topicId = 0;
+    double coordinates[2];
+    double createdAt;
+    double expiresAt;
+
+    bool isLiveAt(double time) const {
+      return !(time < createdAt || time >= expiresAt);
+    }
+  };
+
+  // Sealed bucket: an implicit KD-Tree whose ranges are rooted at their
+  // median, split on the axis given by the depth parity.
+  class Partition {
+   public:
+    double bucketStart = 0.0;
+    vector<Item> items;
+    Node::Box box;
+    // Span of time in which some topic of the partition is live.
+    double minCreatedAt;
+    double maxExpiresAt;
+
+    bool deadAt(double time) const {
+      return time < minCreatedAt || time >= maxExpiresAt;
+    }
+    void kNNTopics(int begin, int end, int depth,
+                   const vector<double> &position, int k, double time,
+                   ResultHeap *results) const;
+    void kNNQuestions(int begin, int end, int depth,
+                      const vector<double> &position, double time,
+                      GroupQuestions *results) const;
+  };
+
+  double bucketWidth;
+  deque<Partition> sealed;
+  // The open bucket keeps its topics twice: in the tree for queries and in
+  // the list it is sealed from. It starts at the bucket of the first insert.
+  double openStart = -std::numeric_limits<double>::infinity();
+  unique_ptr<KDTree> openTree;
+  vector<Item> openItems;
+  // Frees of the open trees given up by seal and expireBefore, which run on
+  // their own threads so that neither walks every node of a bucket.
+  vector<future<void>> pendingFrees;
+
+  void seal();
+  void replaceOpenTree();
+  // Sealed partitions ordered by their distance to the position.
+  vector<const Partition*> nearestFirst(const vector<double> &position) const;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _TIME_PARTITIONS_H
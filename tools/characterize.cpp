@@ -0,0 +1,460 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Workload report for an input file, with a recommended configuration.
+ *
+ * Reads input in the solver's T/Q/N format and describes it the way the
+ * choice of engine depends on it:
+ *
+ * - where the topics are: bounding box, how many of the jump table's grid
+ *   cells hold any, how crowded the densest are, the Clark-Evans ratio of
+ *   mean nearest neighbor distance to that of as many uniformly random
+ *   points (below 1 clustered, about 1 random, above 1 regular), measured
+ *   on a sample with the KD-Tree itself, and how many points repeat;
+ * - how questions and topics are linked, both ways;
+ * - the mix of query types and the k they ask for;
+ * - the depth of the KD-Tree built by inserting the topics in input order,
+ *   replayed with the split rule of KDTree::insert, against a balanced one.
+ *
+ * The recommendations at the end follow from these figures and a memory
+ * budget, by default half of the physical memory.
+ *
+ * Build from the top of the tree with
+ *   g++ -std=c++14 -O2 -pthread -DNEARBY_NO_MAIN tools/characterize.cpp \
+ *     *.cpp -o characterize
+ * and run as characterize [memory budget in MB] < input.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../input_reader.h"
+#include "../jump_table.h"
+#include "../nearby.h"
+
+namespace NearbySolver {
+
+using std::cout;
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+namespace {
+
+constexpr int MAX_NEIGHBOR_SAMPLES = 20000;
+constexpr uint64_t SAMPLE_SEED = 1;
+// Insert recursion this deep risks the stack of the default main thread.
+constexpr int DEEP_RECURSION = 10000;
+
+class Point {
+ public:
+  double x, y;
+};
+
+// Summary of a list of values; the percentiles are nearest rank.
+class Distribution {
+ public:
+  void add(double value) { values.push_back(value); }
+  size_t count() const { return values.size(); }
+  double mean() const {
+    double sum = 0.0;
+    for (double value : values)
+      sum += value;
+    return values.empty() ? 0.0 : sum / values.size();
+  }
+  double percentile(double fraction) {
+    if (values.empty())
+      return 0.0;
+    if (!sorted) {
+      std::sort(values.begin(), values.end());
+      sorted = true;
+    }
+    size_t rank = static_cast<size_t>(ceil(fraction * values.size()));
+    return values[min(values.size() - 1, rank == 0 ? 0 : rank - 1)];
+  }
+  // Share of the values that are at least the threshold.
+  void print(const string &label) {
+    cout << "  " << std::left << std::setw(24) << label << std::right
+         << "mean " << mean() << ", min " << percentile(0.0)
+         << ", median " << percentile(0.5) << ", p90 " << percentile(0.9)
+         << ", p99 " << percentile(0.99) << ", max " << percentile(1.0)
+         << "\n";
+  }
+
+ private:
+  vector<double> values;
+  bool sorted = false;
+};
+
+void printFigure(const string &label, double value, const char *unit = "") {
+  cout << "  " << std::left << std::setw(24) << label << std::right
+       << value << unit << "\n";
+}
+
+void printCount(const string &label, int64_t count) {
+  cout << "  " << std::left << std::setw(24) << label << std::right
+       << count << "\n";
+}
+
+double percent(double part, double whole) {
+  return whole <= 0.0 ? 0.0 : 100.0 * part / whole;
+}
+
+// Depths of the KD-Tree built by inserting the points in order. The replay
+// stops at the first insert deeper than DEEP_RECURSION, as input sorted
+// along an axis would otherwise cost time quadratic in the number of topics;
+// the maximum is then a lower bound and the mean covers the topics inserted
+// so far.
+class InsertionDepths {
+ public:
+  int maximum;
+  double mean;
+  bool stopped;
+  size_t numInserted;
+};
+
+// Replays KDTree::insert: x splits at even depths and y at odd ones, and ties
+// go right. Iterative, since input sorted along an axis makes a chain.
+InsertionDepths insertionDepths(const vector<Point> &points) {
+  vector<int> left(points.size(), -1), right(points.size(), -1);
+  int maxDepth = 0;
+  double depthSum = 0.0;
+  size_t i = 1;
+  for (; i < points.size() && maxDepth <= DEEP_RECURSION; ++i) {
+    int current = 0, depth = 0;
+    while (true) {
+      bool goesLeft = depth % 2 == 0 ? points[i].x < points[current].x :
+        points[i].y < points[current].y;
+      int &child = goesLeft ? left[current] : right[current];
+      ++depth;
+      if (child < 0) {
+        child = static_cast<int>(i);
+        break;
+      }
+      current = child;
+    }
+    maxDepth = max(maxDepth, depth);
+    depthSum += depth;
+  }
+  size_t numInserted = min(i, points.size());
+  return {maxDepth + 1,
+          numInserted == 0 ? 0.0 : depthSum / numInserted + 1,
+          maxDepth > DEEP_RECURSION, numInserted};
+}
+
+// Rough resident size of the in-memory index: tree nodes, the topic and
+// question maps and the question lists before compression.
+double estimateIndexBytes(int64_t numTopics, int64_t numQuestions,
+                          int64_t numLinks) {
+  const double hashEntryOverhead = 2 * sizeof(void*);
+  return numTopics * (sizeof(Node) + sizeof(Topic) + hashEntryOverhead) +
+    numQuestions * (sizeof(Question) + hashEntryOverhead) +
+    numLinks * sizeof(int);
+}
+
+double defaultMemoryBudget() {
+  long pages = sysconf(_SC_PHYS_PAGES), pageBytes = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || pageBytes <= 0)
+    return numeric_limits<double>::infinity();
+  return 0.5 * static_cast<double>(pages) * pageBytes;
+}
+
+}  // namespace
+
+int characterize(int argc, char **argv) {
+  double memoryBudget = argc > 1 ? atof(argv[1]) * (1 << 20) :
+    defaultMemoryBudget();
+
+  InputReader input(STDIN_FILENO);
+  int T = 0, Q = 0, N = 0;
+  if (!(input >> T >> Q >> N)) {
+    std::cerr << "Expected the topic, question and query counts."
+              << std::endl;
+    return 1;
+  }
+
+  vector<Point> points;
+  vector<int> topicIds;
+  unordered_map<int, int> topicIndex;
+  points.reserve(T);
+  topicIds.reserve(T);
+  for (int i = 0; i < T && input; ++i) {
+    Topic topic;
+    input >> topic;
+    topicIndex[topic.getId()] = static_cast<int>(points.size());
+    topicIds.push_back(topic.getId());
+    points.push_back({topic.getX(), topic.getY()});
+  }
+
+  Distribution topicsPerQuestion;
+  vector<int> questionsPerTopic(points.size(), 0);
+  int64_t numLinks = 0, danglingLinks = 0;
+  for (int i = 0; i < Q && input; ++i) {
+    int questionId = 0, topicCount = 0, topicId = 0;
+    input >> questionId >> topicCount;
+    topicsPerQuestion.add(topicCount);
+    for (int j = 0; j < topicCount && input; ++j) {
+      input >> topicId;
+      ++numLinks;
+      auto iter = topicIndex.find(topicId);
+      if (iter == topicIndex.end())
+        ++danglingLinks;
+      else
+        ++questionsPerTopic[iter->second];
+    }
+  }
+
+  Distribution topicK, questionK;
+  int64_t typeCounts[4] = {0, 0, 0, 0}, otherTypes = 0;
+  int64_t queriesOutside = 0;
+  const string types = "tqTQ";
+  vector<Point> queryPoints;
+  for (int i = 0; i < N && input; ++i) {
+    char type = 0;
+    int k = 0;
+    double x = 0.0, y = 0.0, time = 0.0;
+    input >> type >> k >> x >> y;
+    if (type == 'T' || type == 'Q')
+      input >> time;
+    size_t typeIndex = types.find(type);
+    if (typeIndex == string::npos) {
+      ++otherTypes;
+      continue;
+    }
+    ++typeCounts[typeIndex];
+    (type == 't' || type == 'T' ? topicK : questionK).add(k);
+    queryPoints.push_back({x, y});
+  }
+  if (!input)
+    std::cerr << "Input ended early; the figures cover what was read."
+              << std::endl;
+
+  // Spatial distribution.
+  double minX = numeric_limits<double>::infinity(), minY = minX;
+  double maxX = -minX, maxY = -minX;
+  for (const Point &point : points) {
+    minX = min(minX, point.x);
+    maxX = max(maxX, point.x);
+    minY = min(minY, point.y);
+    maxY = max(maxY, point.y);
+  }
+  for (const Point &point : queryPoints) {
+    if (point.x < minX || point.x > maxX || point.y < minY || point.y > maxY)
+      ++queriesOutside;
+  }
+
+  const int gridSize = JumpTable::GRID_SIZE;
+  vector<int> cellCounts(gridSize * gridSize, 0);
+  double width = max(maxX - minX, numeric_limits<double>::min());
+  double height = max(maxY - minY, numeric_limits<double>::min());
+  for (const Point &point : points) {
+    int column = min(gridSize - 1,
+                     static_cast<int>((point.x - minX) / width * gridSize));
+    int row = min(gridSize - 1,
+                  static_cast<int>((point.y - minY) / height * gridSize));
+    ++cellCounts[row * gridSize + column];
+  }
+  int occupiedCells = std::count_if(cellCounts.begin(), cellCounts.end(),
+                                    [](int count) { return count > 0; });
+  vector<int> sortedCells = cellCounts;
+  std::sort(sortedCells.rbegin(), sortedCells.rend());
+  int64_t densestTenth = 0;
+  for (size_t i = 0; i < sortedCells.size() / 10; ++i)
+    densestTenth += sortedCells[i];
+  double meanCell = static_cast<double>(points.size()) / cellCounts.size();
+
+  vector<pair<double, double>> sortedPoints;
+  sortedPoints.reserve(points.size());
+  for (const Point &point : points)
+    sortedPoints.emplace_back(point.x, point.y);
+  std::sort(sortedPoints.begin(), sortedPoints.end());
+  int64_t duplicates = 0;
+  for (size_t i = 1; i < sortedPoints.size(); ++i)
+    duplicates += sortedPoints[i] == sortedPoints[i - 1];
+
+  // Nearest other topic of a sample of the topics, through the reentrant
+  // search of the solver's own tree. It is filled in shuffled order, which
+  // keeps it shallow whatever the input order.
+  std::mt19937_64 random(SAMPLE_SEED);
+  vector<int> insertOrder(points.size());
+  for (size_t i = 0; i < points.size(); ++i)
+    insertOrder[i] = static_cast<int>(i);
+  std::shuffle(insertOrder.begin(), insertOrder.end(), random);
+  KDTree tree;
+  for (int i : insertOrder)
+    tree.insert(Topic(topicIds[i], points[i].x, points[i].y));
+  tree.buildJumpTable();
+  std::uniform_int_distribution<size_t> pick(
+    0, points.empty() ? 0 : points.size() - 1);
+  size_t numSamples = min<size_t>(points.size(), MAX_NEIGHBOR_SAMPLES);
+  double neighborSum = 0.0;
+  for (size_t i = 0; i < numSamples; ++i) {
+    const Point &point = points[pick(random)];
+    ResultHeap results;
+    tree.kNNTopics({point.x, point.y}, 2, &results);
+    if (results.size() == 2)
+      neighborSum += results.top().first;
+  }
+  double meanNeighbor = numSamples == 0 ? 0.0 : neighborSum / numSamples;
+  double expectedNeighbor = points.empty() ? 0.0 :
+    0.5 * sqrt((maxX - minX) * (maxY - minY) / points.size());
+  double clarkEvans =
+    expectedNeighbor > 0.0 ? meanNeighbor / expectedNeighbor : 0.0;
+
+  InsertionDepths depths = insertionDepths(points);
+  int balancedDepth = points.empty() ? 0 :
+    static_cast<int>(floor(log2(static_cast<double>(points.size())))) + 1;
+
+  Distribution questionFanOut;
+  int64_t topicsWithoutQuestions = 0;
+  for (int count : questionsPerTopic) {
+    questionFanOut.add(count);
+    topicsWithoutQuestions += count == 0;
+  }
+  vector<int> busiestTopics = questionsPerTopic;
+  std::sort(busiestTopics.rbegin(), busiestTopics.rend());
+  int64_t busiestLinks = 0;
+  for (size_t i = 0; i < max<size_t>(1, busiestTopics.size() / 100) &&
+       i < busiestTopics.size(); ++i)
+    busiestLinks += busiestTopics[i];
+  double busiestShare = percent(busiestLinks, numLinks - danglingLinks);
+
+  cout << std::fixed << std::setprecision(2);
+  cout << "Input\n";
+  printCount("topics", T);
+  printCount("questions", Q);
+  printCount("queries", N);
+
+  cout << "\nSpatial distribution\n";
+  cout << "  " << std::left << std::setw(24) << "bounding box" << std::right
+       << "[" << minX << ", " << maxX << "] x [" << minY << ", " << maxY
+       << "]\n";
+  printFigure("occupied grid cells",
+              percent(occupiedCells, cellCounts.size()), "%");
+  printFigure("densest cell / mean",
+              meanCell > 0.0 ? sortedCells[0] / meanCell : 0.0);
+  printFigure("topics in densest 10%",
+              percent(densestTenth, points.size()), "%");
+  printFigure("Clark-Evans ratio", clarkEvans);
+  printFigure("duplicate points", percent(duplicates, points.size()), "%");
+  printFigure("queries outside box",
+              percent(queriesOutside, queryPoints.size()), "%");
+
+  cout << "\nQuestion links\n";
+  topicsPerQuestion.print("topics per question");
+  questionFanOut.print("questions per topic");
+  printFigure("topics with none",
+              percent(topicsWithoutQuestions, points.size()), "%");
+  printFigure("links on busiest 1%", busiestShare, "%");
+  if (danglingLinks > 0)
+    printCount("links to unknown topics", danglingLinks);
+
+  cout << "\nQueries\n";
+  int64_t numQueries = static_cast<int64_t>(queryPoints.size());
+  for (size_t i = 0; i < types.size(); ++i) {
+    printFigure(string("type ") + types[i],
+                percent(typeCounts[i], numQueries + otherTypes), "%");
+  }
+  if (otherTypes > 0)
+    printCount("unknown types", otherTypes);
+  if (topicK.count() > 0)
+    topicK.print("k of topic queries");
+  if (questionK.count() > 0)
+    questionK.print("k of question queries");
+
+  cout << "\nKD-Tree in input order\n";
+  if (depths.stopped) {
+    printCount("maximum depth, at least", depths.maximum);
+    printFigure("mean depth, first " + std::to_string(depths.numInserted),
+                depths.mean);
+  } else {
+    printCount("maximum depth", depths.maximum);
+    printFigure("mean depth", depths.mean);
+  }
+  printCount("balanced depth", balancedDepth);
+  double indexBytes = estimateIndexBytes(points.size(), Q, numLinks);
+  printFigure("estimated index size", indexBytes / (1 << 20), " MB");
+
+  cout << "\nRecommendations\n";
+  bool memoryFits = indexBytes <= memoryBudget;
+  if (memoryFits) {
+    cout << "- Keep the index in memory: it needs about "
+         << indexBytes / (1 << 20) << " MB of a " << memoryBudget / (1 << 20)
+         << " MB budget.\n";
+  } else {
+    int poolBlocks = static_cast<int>(memoryBudget / 2 / (16 << 10));
+    cout << "- Use the DiskIndex: the in-memory index needs about "
+         << indexBytes / (1 << 20) << " MB, over the "
+         << memoryBudget / (1 << 20) << " MB budget. Start with 16 KB "
+         << "blocks, a pool of " << max(1, poolBlocks) << " blocks and 2 "
+         << "pinned levels.\n";
+  }
+
+  // Random order leaves the mean depth about 1.3 times the balanced one.
+  if (depths.mean > 1.5 * balancedDepth || depths.stopped) {
+    cout << "- Call KDTree::rebalance() after loading: input order gives a "
+         << "mean depth of " << depths.mean << " and a maximum of ";
+    if (depths.stopped)
+      cout << "at least ";
+    cout << depths.maximum << " where " << balancedDepth << " would do.";
+    if (depths.stopped)
+      cout << " The recursive inserts and searches may run out of stack.";
+    cout << "\n";
+  } else {
+    cout << "- Insert in input order: it leaves the tree about as deep "
+         << "as a random order would.\n";
+  }
+  if (duplicates * 100 > static_cast<int64_t>(points.size())) {
+    cout << "- " << percent(duplicates, points.size()) << "% of the topics "
+         << "repeat a point; ties always go right, so repeated points form "
+         << "chains that only a rebalance spreads out.\n";
+  }
+
+  if (points.empty()) {
+    // Nothing to say about the layout.
+  } else if (occupiedCells * 4 < static_cast<int>(cellCounts.size()) ||
+             clarkEvans < 0.5) {
+    cout << "- The topics are clustered, so most of the jump table's "
+         << gridSize << " x " << gridSize << " cells are empty and queries "
+         << "in the clusters start near the root; the gain from the table "
+         << "is small.\n";
+  } else {
+    cout << "- The topics are spread out; the jump table lets most "
+         << "reentrant searches start deep in the tree.\n";
+  }
+
+  if (typeCounts[1] + typeCounts[3] > 0 && busiestShare > 50.0) {
+    cout << "- The busiest 1% of the topics carry " << busiestShare
+         << "% of the question links; question queries near them touch "
+         << "many questions and benefit most from the compressed "
+         << "adjacency.\n";
+  }
+  if (minX >= -180.0 && maxX <= 180.0 && minY >= -90.0 && maxY <= 90.0 &&
+      (maxX - minX > 10.0 || maxY - minY > 10.0)) {
+    cout << "- The coordinates fit longitudes and latitudes over a wide "
+         << "area; if that is what they are, VPTree<HaversineMetric> ranks "
+         << "by great-circle distance.\n";
+  }
+  return 0;
+}
+
+}  // namespace NearbySolver
+
+int main(int argc, char **argv) {
+  return NearbySolver::characterize(argc, argv);
+}
@@ -0,0 +1,611 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Microbenchmarks of the hot components of the solver.
+ *
+ * End-to-end runs show that a change helped but not where. Each benchmark
+ * here times one component on data drawn from a fixed seed, so that two
+ * builds see the same topics, questions and queries: the comparison
+ * operators, the result accumulators, tree construction, a node of the
+ * question search, the compressed question lists against plain vectors,
+ * the input parser, the output formatting, inserts racing reentrant
+ * queries, and the disk index with a cold and a warm page cache.
+ *
+ * The process is pinned to the CPU it starts on, apart from the threads of
+ * the mixed benchmark, which get one allowed CPU each. Every benchmark runs
+ * a few times untimed to warm the caches, the allocator and the query
+ * arenas, then is timed over several runs; the median and the extremes per
+ * operation are reported, the spread showing how far a single run can be
+ * trusted. Setup between runs is not timed.
+ *
+ * Build from the top of the tree with
+ *   g++ -std=c++14 -O2 -pthread -DNEARBY_NO_MAIN tools/microbench.cpp *.cpp \
+ *     -o microbench
+ * and pass benchmark names, or parts of them, to run only those.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../disk_index.h"
+#include "../epoch.h"
+#include "../input_reader.h"
+#include "../metrics.h"
+#include "../nearby.h"
+#include "../question_adjacency.h"
+
+namespace NearbySolver {
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::cout;
+using std::function;
+using std::mt19937_64;
+using std::string;
+using std::thread;
+using std::uniform_int_distribution;
+using std::uniform_real_distribution;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+constexpr uint64_t SEED = 0x4e6561726279ULL;
+constexpr int WARMUP_RUNS = 3;
+constexpr int MEASURED_RUNS = 11;
+
+constexpr int NUM_TOPICS = 100000;
+constexpr int NUM_QUESTIONS = 100000;
+constexpr int MAX_TOPICS_PER_QUESTION = 10;
+constexpr int NUM_QUERIES = 10000;
+constexpr double COORDINATE_RANGE = 1000.0;
+constexpr int ACCUMULATOR_K = 100;
+
+// Keeps results alive so that the work producing them is not optimized out.
+volatile uint64_t sink = 0;
+
+// The allowed CPUs at start, before the process pins itself.
+cpu_set_t allowedCpus;
+
+vector<int> allowedCpuList() {
+  vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowedCpus))
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+bool pinCurrentThread(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+// Discards everything written to it, so that formatting is timed without
+// the cost of a terminal or a pipe.
+class NullBuffer : public std::streambuf {
+ protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char*, std::streamsize count) override {
+    return count;
+  }
+};
+
+class Benchmark {
+ public:
+  string name;
+  // Untimed preparation before every run.
+  function<void()> setup;
+  // Returns the number of operations the run did.
+  function<uint64_t()> run;
+};
+
+void runBenchmark(const Benchmark &benchmark) {
+  for (int i = 0; i < WARMUP_RUNS; ++i) {
+    if (benchmark.setup)
+      benchmark.setup();
+    sink = sink + benchmark.run();
+  }
+
+  vector<double> nanosPerOperation;
+  for (int i = 0; i < MEASURED_RUNS; ++i) {
+    if (benchmark.setup)
+      benchmark.setup();
+    steady_clock::time_point start = steady_clock::now();
+    uint64_t operations = benchmark.run();
+    double seconds = duration<double>(steady_clock::now() - start).count();
+    nanosPerOperation.push_back(seconds * 1e9 / std::max<uint64_t>(
+      operations, 1));
+  }
+  std::sort(nanosPerOperation.begin(), nanosPerOperation.end());
+  double median = nanosPerOperation[nanosPerOperation.size() / 2];
+  double spread = (nanosPerOperation.back() - nanosPerOperation.front()) /
+    median * 100.0;
+  cout << std::left << std::setw(28) << benchmark.name << std::right
+       << std::fixed << std::setprecision(2)
+       << std::setw(14) << median
+       << std::setw(14) << nanosPerOperation.front()
+       << std::setw(14) << nanosPerOperation.back()
+       << std::setw(9) << std::setprecision(1) << spread << "%" << std::endl;
+}
+
+vector<double> randomPosition(mt19937_64 *random) {
+  uniform_real_distribution<double> coordinate(0.0, COORDINATE_RANGE);
+  double x = coordinate(*random);
+  return {x, coordinate(*random)};
+}
+
+vector<Topic> randomTopics(int count, int firstId, mt19937_64 *random) {
+  uniform_real_distribution<double> coordinate(0.0, COORDINATE_RANGE);
+  vector<Topic> result;
+  result.reserve(count);
+  for (int i = 0; i < count; ++i) {
+    double x = coordinate(*random);
+    result.emplace_back(firstId + i, x, coordinate(*random));
+  }
+  return result;
+}
+
+// Input in the solver's format with the same topics, questions and
+// queries as the loaded index.
+string generateInput(const vector<Topic> &allTopics,
+                     const vector<vector<int>> &questionTopics,
+                     const vector<vector<double>> &queryPositions) {
+  string text;
+  char line[128];
+  snprintf(line, sizeof(line), "%zu %zu %zu\n", allTopics.size(),
+           questionTopics.size(), queryPositions.size());
+  text += line;
+  for (const Topic &topic : allTopics) {
+    snprintf(line, sizeof(line), "%d %.1f %.1f\n", topic.getId(),
+             topic.getX(), topic.getY());
+    text += line;
+  }
+  for (size_t id = 0; id < questionTopics.size(); ++id) {
+    text += std::to_string(id) + " " +
+      std::to_string(questionTopics[id].size());
+    for (int topicId : questionTopics[id])
+      text += " " + std::to_string(topicId);
+    text += "\n";
+  }
+  for (size_t i = 0; i < queryPositions.size(); ++i) {
+    snprintf(line, sizeof(line), "%c 10 %.1f %.1f\n", i % 2 ? 'q' : 't',
+             queryPositions[i][0], queryPositions[i][1]);
+    text += line;
+  }
+  return text;
+}
+
+// Parses input of the solver's format without touching the index, with the
+// InputReader or a stream; returns the number of records read.
+template <typename Reader>
+uint64_t parseInput(Reader *input) {
+  int numTopics = 0, numQuestions = 0, numQueries = 0;
+  *input >> numTopics >> numQuestions >> numQueries;
+  uint64_t checksum = 0;
+  Topic topic;
+  for (int i = 0; i < numTopics; ++i) {
+    *input >> topic;
+    checksum += topic.getId();
+  }
+  for (int i = 0; i < numQuestions; ++i) {
+    int questionId = 0, topicCount = 0, topicId = 0;
+    *input >> questionId >> topicCount;
+    for (int j = 0; j < topicCount; ++j) {
+      *input >> topicId;
+      checksum += topicId;
+    }
+  }
+  for (int i = 0; i < numQueries; ++i) {
+    char type = 0;
+    int k = 0;
+    double x = 0.0, y = 0.0;
+    *input >> type >> k >> x >> y;
+    checksum += type + k;
+  }
+  sink = sink + checksum;
+  return static_cast<uint64_t>(numTopics) + numQuestions + numQueries;
+}
+
+string temporaryPath(const char *name) {
+  const char *directory = getenv("TMPDIR");
+  return string(directory != nullptr ? directory : "/tmp") + "/" + name +
+    "." + std::to_string(getpid());
+}
+
+bool writeFile(const string &path, const string &text) {
+  std::ofstream out(path, std::ios::binary);
+  out << text;
+  return static_cast<bool>(out.flush());
+}
+
+// Writes back and evicts a file from the page cache, so that the next
+// reads come from the device.
+void dropFromPageCache(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  ::close(fd);
+}
+
+// Shared data of the benchmarks: the solver's index loaded the way solve()
+// loads it, plus the same topics, questions, question lists and queries as
+// plain vectors.
+class Fixture {
+ public:
+  vector<Topic> allTopics;
+  vector<vector<int>> questionTopics;
+  // Sorted question ids of every topic, as the adjacency holds them.
+  vector<vector<int>> topicQuestions;
+  vector<vector<double>> queryPositions;
+
+  Fixture() {
+    mt19937_64 random(SEED);
+    allTopics = randomTopics(NUM_TOPICS, 0, &random);
+    uniform_int_distribution<int> topicCount(0, MAX_TOPICS_PER_QUESTION);
+    uniform_int_distribution<int> topicId(0, NUM_TOPICS - 1);
+    questionTopics.resize(NUM_QUESTIONS);
+    for (vector<int> &linked : questionTopics) {
+      linked.resize(topicCount(random));
+      for (int &id : linked)
+        id = topicId(random);
+    }
+    for (int i = 0; i < NUM_QUERIES; ++i)
+      queryPositions.push_back(randomPosition(&random));
+
+    for (const Topic &topic : allTopics)
+      kdtree.insert(topics[topic.getId()] = topic);
+    for (size_t id = 0; id < questionTopics.size(); ++id) {
+      int questionId = static_cast<int>(id);
+      questions[questionId] = Question(
+        questionId, static_cast<int>(questionTopics[id].size()));
+      for (int linked : questionTopics[id])
+        topics[linked].getQuestionIds().push_back(questionId);
+    }
+    topicQuestions.resize(NUM_TOPICS);
+    for (int id = 0; id < NUM_TOPICS; ++id) {
+      topicQuestions[id] = topics[id].getQuestionIds();
+      std::sort(topicQuestions[id].begin(), topicQuestions[id].end());
+    }
+    questionAdjacency.build(&topics);
+    kdtree.buildJumpTable();
+  }
+
+  // Bytes the question lists take as exactly sized vectors.
+  size_t vectorBytes() const {
+    size_t result = 0;
+    for (const vector<int> &questionIds : topicQuestions)
+      result += sizeof(questionIds) + questionIds.size() * sizeof(int);
+    return result;
+  }
+};
+
+// Sums the question ids of every topic of the fixture, decoded from the
+// compressed adjacency, and returns how many were decoded.
+uint64_t decodeQuestionLists(bool scalar) {
+  vector<int> questionIds;
+  uint64_t total = 0, decoded = 0;
+  for (int topicId = 0; topicId < NUM_TOPICS; ++topicId) {
+    if (scalar)
+      questionAdjacency.decodeScalar(topicId, &questionIds);
+    else
+      questionAdjacency.decode(topicId, &questionIds);
+    for (int questionId : questionIds)
+      total += questionId;
+    decoded += questionIds.size();
+  }
+  sink = sink + total;
+  return decoded;
+}
+
+vector<Benchmark> makeBenchmarks(const Fixture &fixture) {
+  vector<Benchmark> benchmarks;
+  const vector<Topic> &allTopics = fixture.allTopics;
+  const vector<vector<double>> &queryPositions = fixture.queryPositions;
+
+  // Pairs of topics compared from the same query position, as by the
+  // topic set.
+  benchmarks.push_back({"topic_less", nullptr, [&allTopics]() {
+    queryPosition = {COORDINATE_RANGE / 2, COORDINATE_RANGE / 2};
+    uint64_t less = 0;
+    for (size_t i = 1; i < allTopics.size(); ++i)
+      less += allTopics[i - 1] < allTopics[i];
+    sink = sink + less;
+    return static_cast<uint64_t>(allTopics.size() - 1);
+  }});
+
+  // Pairs of questions, each ranked through the closest topic recorded
+  // for it, drawn from a set small enough that filling the map as a
+  // question search would is a negligible part of the run.
+  benchmarks.push_back({"question_less", nullptr, []() {
+    const int numIds = 1 << 12, numPairs = 1 << 20;
+    QueryScope scope;
+    queryPosition = {COORDINATE_RANGE / 2, COORDINATE_RANGE / 2};
+    for (int id = 0; id < numIds; ++id)
+      closestQuestionTopic[id] = (id * 7919) % NUM_TOPICS;
+    uint64_t less = 0;
+    for (int i = 0; i < numPairs; ++i) {
+      less += questions[i & (numIds - 1)] <
+        questions[(i * 31 + 7) & (numIds - 1)];
+    }
+    sink = sink + less;
+    return static_cast<uint64_t>(numPairs);
+  }});
+
+  // The k best of a stream of topics, kept in the shared topic set as the
+  // shared-state search does, or in a result heap as the reentrant one.
+  benchmarks.push_back({"accumulator_topic_set", nullptr, [&allTopics]() {
+    QueryScope scope;
+    queryPosition = {COORDINATE_RANGE / 2, COORDINATE_RANGE / 2};
+    topicSet.clear();
+    for (const Topic &topic : allTopics) {
+      topicSet.insert(topic);
+      while (static_cast<int>(topicSet.size()) > ACCUMULATOR_K)
+        topicSet.erase(prev(topicSet.cend()));
+    }
+    sink = sink + topicSet.begin()->getId();
+    return static_cast<uint64_t>(allTopics.size());
+  }});
+  benchmarks.push_back({"accumulator_result_heap", nullptr, [&allTopics]() {
+    vector<double> position = {COORDINATE_RANGE / 2, COORDINATE_RANGE / 2};
+    ResultHeap results;
+    for (const Topic &topic : allTopics) {
+      results.emplace(hypot(position[0] - topic.getX(),
+                            position[1] - topic.getY()),
+                      topic.getId());
+      if (static_cast<int>(results.size()) > ACCUMULATOR_K)
+        results.pop();
+    }
+    sink = sink + results.top().second;
+    return static_cast<uint64_t>(allTopics.size());
+  }});
+
+  // One topic at a time in input order, against a balanced build of the
+  // same topics as done by rebalance().
+  auto insertedTree = std::make_shared<unique_ptr<KDTree>>();
+  benchmarks.push_back({"kdtree_insert", [insertedTree]() {
+    insertedTree->reset(new KDTree());
+  }, [insertedTree, &allTopics]() {
+    for (const Topic &topic : allTopics)
+      (*insertedTree)->insert(topic);
+    return static_cast<uint64_t>(allTopics.size());
+  }});
+  auto bulkTree = std::make_shared<unique_ptr<KDTree>>();
+  benchmarks.push_back({"kdtree_bulk_build", [bulkTree, &allTopics]() {
+    bulkTree->reset(new KDTree());
+    for (const Topic &topic : allTopics)
+      (*bulkTree)->insert(topic);
+  }, [bulkTree, &allTopics]() {
+    (*bulkTree)->rebalance();
+    epochs.reclaim();
+    return static_cast<uint64_t>(allTopics.size());
+  }});
+
+  // Time per node of the question search at k = 10, the whole query
+  // divided by the nodes it visited.
+  benchmarks.push_back({"knn_questions_node_visit", nullptr,
+                        [&queryPositions]() {
+    uint64_t visitsBefore = nodeVisits;
+    numResults = 10;
+    queryTime = ANY_TIME;
+    for (const vector<double> &position : queryPositions) {
+      QueryScope scope;
+      queryPosition = position;
+      questionSet.clear();
+      closestQuestionTopic.clear();
+      visitedQuestions.configure(NUM_QUESTIONS, numResults);
+      kdtree.kNNQuestions(queryPosition);
+      sink = sink + questionSet.size();
+    }
+    return nodeVisits - visitsBefore;
+  }});
+
+  // Every topic's question list, per id, decoded from the Stream VByte
+  // adjacency with the SSSE3 shuffle and on the scalar path, and read from
+  // the vectors the adjacency replaces. The shuffle is only there in builds
+  // with SSSE3 enabled, such as -march=native.
+#if defined(__SSSE3__)
+  benchmarks.push_back({"adjacency_decode_ssse3", nullptr, []() {
+    return decodeQuestionLists(false);
+  }});
+#endif
+  benchmarks.push_back({"adjacency_decode_scalar", nullptr, []() {
+    return decodeQuestionLists(true);
+  }});
+  const vector<vector<int>> &topicQuestions = fixture.topicQuestions;
+  benchmarks.push_back({"adjacency_vector_iterate", nullptr,
+                        [&topicQuestions]() {
+    uint64_t total = 0, read = 0;
+    for (const vector<int> &questionIds : topicQuestions) {
+      for (int questionId : questionIds)
+        total += questionId;
+      read += questionIds.size();
+    }
+    sink = sink + total;
+    return read;
+  }});
+
+  // The whole input, per record, through the InputReader that solve()
+  // uses and through an ifstream for comparison.
+  string inputPath = temporaryPath("nearby_microbench_input");
+  writeFile(inputPath, generateInput(allTopics, fixture.questionTopics,
+                                     queryPositions));
+  benchmarks.push_back({"parse_input_reader", nullptr, [inputPath]() {
+    int fd = ::open(inputPath.c_str(), O_RDONLY);
+    if (fd < 0)
+      return static_cast<uint64_t>(0);
+    uint64_t records;
+    {
+      InputReader input(fd);
+      records = parseInput(&input);
+    }
+    ::close(fd);
+    return records;
+  }});
+  benchmarks.push_back({"parse_istream", nullptr, [inputPath]() {
+    std::ifstream input(inputPath);
+    return parseInput(&input);
+  }});
+
+  // Printing the result sets of k = 100 queries, per id printed.
+  benchmarks.push_back({"print_topic_set", nullptr, [&queryPositions]() {
+    NullBuffer discard;
+    std::streambuf *standardOutput = cout.rdbuf(&discard);
+    uint64_t printed = 0;
+    numResults = 100;
+    queryTime = ANY_TIME;
+    QueryScope scope;
+    queryPosition = queryPositions[0];
+    topicSet.clear();
+    kdtree.kNNTopics(queryPosition);
+    for (int i = 0; i < 1000; ++i) {
+      printSet(topicSet);
+      printed += topicSet.size();
+    }
+    cout.rdbuf(standardOutput);
+    return printed;
+  }});
+  benchmarks.push_back({"print_question_set", nullptr, [&queryPositions]() {
+    NullBuffer discard;
+    std::streambuf *standardOutput = cout.rdbuf(&discard);
+    uint64_t printed = 0;
+    numResults = 100;
+    queryTime = ANY_TIME;
+    QueryScope scope;
+    queryPosition = queryPositions[0];
+    questionSet.clear();
+    closestQuestionTopic.clear();
+    visitedQuestions.configure(NUM_QUESTIONS, numResults);
+    kdtree.kNNQuestions(queryPosition);
+    for (int i = 0; i < 1000; ++i) {
+      printSet(questionSet);
+      printed += questionSet.size();
+    }
+    cout.rdbuf(standardOutput);
+    return printed;
+  }});
+
+  // One thread inserting concurrently into a tree while the others run
+  // reentrant k = 10 queries on it, per insert or query done.
+  auto mixedTree = std::make_shared<unique_ptr<KDTree>>();
+  benchmarks.push_back({"mixed_insert_query", [mixedTree, &allTopics]() {
+    mixedTree->reset(new KDTree());
+    for (size_t i = 0; i < allTopics.size() / 2; ++i)
+      (*mixedTree)->insert(allTopics[i]);
+  }, [mixedTree, &allTopics, &queryPositions]() {
+    vector<int> cpus = allowedCpuList();
+    int numReaders = std::max(1, static_cast<int>(cpus.size()) - 1);
+    KDTree *tree = mixedTree->get();
+    vector<thread> threads;
+    threads.emplace_back([&]() {
+      pinCurrentThread(cpus[0]);
+      for (size_t i = allTopics.size() / 2; i < allTopics.size(); ++i)
+        tree->insertConcurrent(allTopics[i]);
+    });
+    for (int reader = 0; reader < numReaders; ++reader) {
+      threads.emplace_back([&, reader]() {
+        pinCurrentThread(cpus[(reader + 1) % cpus.size()]);
+        uint64_t found = 0;
+        for (const vector<double> &position : queryPositions) {
+          ResultHeap results;
+          tree->kNNTopics(position, 10, &results);
+          found += results.size();
+        }
+        sink = sink + found;
+      });
+    }
+    for (thread &worker : threads)
+      worker.join();
+    epochs.reclaim();
+    return static_cast<uint64_t>(allTopics.size() - allTopics.size() / 2 +
+                                 numReaders * queryPositions.size());
+  }});
+
+  // k = 10 queries on the disk index with a 256 block pool and the root
+  // block pinned, from an evicted file and from the page cache.
+  string diskPath = temporaryPath("nearby_microbench_index");
+  DiskIndex::write(diskPath, topics, 16 << 10);
+  auto diskIndex = std::make_shared<DiskIndex>();
+  auto diskQueries = [diskIndex, &queryPositions]() {
+    uint64_t found = 0;
+    for (const vector<double> &position : queryPositions) {
+      ResultHeap results;
+      diskIndex->kNNTopics(position, 10, &results);
+      found += results.size();
+    }
+    sink = sink + found;
+    return static_cast<uint64_t>(queryPositions.size());
+  };
+  benchmarks.push_back({"disk_knn_cold", [diskIndex, diskPath]() {
+    diskIndex->close();
+    dropFromPageCache(diskPath);
+    diskIndex->open(diskPath, 256, 1);
+  }, diskQueries});
+  benchmarks.push_back({"disk_knn_warm", [diskIndex, diskPath, diskQueries]() {
+    diskIndex->close();
+    diskIndex->open(diskPath, 256, 1);
+    diskQueries();
+  }, diskQueries});
+  return benchmarks;
+}
+
+}  // namespace
+
+int runMicrobenchmarks(int argc, char **argv) {
+  sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus);
+  int cpu = sched_getcpu();
+  if (cpu < 0 || !pinCurrentThread(cpu))
+    std::cerr << "Could not pin to a CPU; timings may be noisy."
+              << std::endl;
+
+  Fixture fixture;
+  vector<Benchmark> benchmarks = makeBenchmarks(fixture);
+  cout << NUM_TOPICS << " topics, " << NUM_QUESTIONS << " questions, "
+       << NUM_QUERIES << " queries, seed " << SEED << ", pinned to CPU "
+       << cpu << ", " << MEASURED_RUNS << " runs after " << WARMUP_RUNS
+       << " warm-up runs" << std::endl;
+  cout << "question lists: " << questionAdjacency.memoryBytes()
+       << " bytes compressed, " << fixture.vectorBytes()
+       << " bytes as vector<int>" << std::endl;
+  cout << std::left << std::setw(28) << "benchmark" << std::right
+       << std::setw(14) << "median ns/op" << std::setw(14) << "min"
+       << std::setw(14) << "max" << std::setw(10) << "spread" << std::endl;
+  for (const Benchmark &benchmark : benchmarks) {
+    bool selected = argc <= 1;
+    for (int i = 1; i < argc; ++i)
+      selected = selected || benchmark.name.find(argv[i]) != string::npos;
+    if (selected)
+      runBenchmark(benchmark);
+  }
+
+  unlink(temporaryPath("nearby_microbench_input").c_str());
+  unlink(temporaryPath("nearby_microbench_index").c_str());
+  return 0;
+}
+
+}  // namespace NearbySolver
+
+int main(int argc, char **argv) {
+  return NearbySolver::runMicrobenchmarks(argc, argv);
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Append-only binary log of online index updates.
+ *
+ * Record layout, native endian: type (1 byte), topic id (4), question id (4),
+ * x (8), y (8), for a timed topic its creation (8) and expiry (8) times,
+ * then a 32-bit FNV-1a checksum of the preceding bytes. Lifetime records
+ * keep the times in x and y instead.
+ */
+
+#include "./update_log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+namespace NearbySolver {
+
+using std::string;
+
+constexpr int UpdateLog::RECORD_SIZE;
+constexpr int UpdateLog::TIMED_RECORD_SIZE;
+constexpr int UpdateLog::GROUP_COMMIT_RECORDS;
+
+static uint32_t checksum(const char *data, int size) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void UpdateRecord::apply() const {
+  switch (type) {
+    case UPDATE_ADD_TOPIC:
+      addTopic(Topic(topicId, x, y));
+      break;
+    case UPDATE_ADD_TIMED_TOPIC: {
+      Topic topic(topicId, x, y);
+      topic.setLifetime(createdAt, expiresAt);
+      addTopic(topic);
+      break;
+    }
+    case UPDATE_MOVE_TOPIC:
+      moveTopic(topicId, x, y);
+      break;
+    case UPDATE_LINK_QUESTION:
+      linkQuestion(questionId, topicId);
+      break;
+    case UPDATE_SET_LIFETIME:
+      setTopicLifetime(topicId, x, y);
+      break;
+    default:
+      break;
+  }
+}
+
+bool UpdateLog::open(const string &path) {
+  close();
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  return fd >= 0;
+}
+
+bool UpdateLog::close() {
+  if (fd < 0)
+    return true;
+  bool committed = commit();
+  ::close(fd);
+  fd = -1;
+  buffer.clear();
+  return committed;
+}
+
+bool UpdateLog::rotate(const string &path) {
+  if (!commit())
+    return false;
+  int next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (next < 0)
+    return false;
+  ::close(fd);
+  fd = next;
+  return true;
+}
+
+bool UpdateLog::append(const UpdateRecord &record) {
+  if (fd < 0)
+    return false;
+
+  int size = recordSize(record.type);
+  char data[TIMED_RECORD_SIZE];
+  char *cursor = data;
+  *cursor++ = static_cast<char>(record.type);
+  memcpy(cursor, &record.topicId, sizeof(record.topicId));
+  cursor += sizeof(record.topicId);
+  memcpy(cursor, &record.questionId, sizeof(record.questionId));
+  cursor += sizeof(record.questionId);
+  memcpy(cursor, &record.x, sizeof(record.x));
+  cursor += sizeof(record.x);
+  memcpy(cursor, &record.y, sizeof(record.y));
+  cursor += sizeof(record.y);
+  if (record.type == UPDATE_ADD_TIMED_TOPIC) {
+    memcpy(cursor, &record.createdAt, sizeof(record.createdAt));
+    cursor += sizeof(record.createdAt);
+    memcpy(cursor, &record.expiresAt, sizeof(record.expiresAt));
+    cursor += sizeof(record.expiresAt);
+  }
+  uint32_t hash = checksum(data, static_cast<int>(cursor - data));
+  memcpy(cursor, &hash, sizeof(hash));
+
+  buffer.append(data, size);
+  if (static_cast<int>(buffer.size()) >= GROUP_COMMIT_RECORDS * RECORD_SIZE &&
+      !commit() && static_cast<int>(buffer.size()) >= size) {
+    // None of the record reached the file, so it can still be left out.
+    buffer.resize(buffer.size() - size);
+    return false;
+  }
+  return true;
+}
+
+bool UpdateLog::commit() {
+  if (fd < 0)
+    return false;
+
+  size_t written = 0;
+  while (written < buffer.size()) {
+    ssize_t result =
+      ::write(fd, buffer.data() + written, buffer.size() - written);
+    if (result < 0) {
+      // Whatever reached the file stays there, so only the rest is kept
+      // for the next commit; the file and the buffer still hold every
+      // record exactly once, end to end.
+      buffer.erase(0, written);
+      return false;
+    }
+    written += result;
+  }
+  buffer.clear();
+  return fdatasync(fd) == 0;
+}
+
+int UpdateLog::replay(const string &path,
+                      const function<void(const UpdateRecord&)> &visit) {
+  int input = ::open(path.c_str(), O_RDONLY);
+  if (input < 0)
+    return -1;
+
+  int count = 0;
+  char data[TIMED_RECORD_SIZE];
+  while (::read(input, data, 1) == 1) {
+    int size = recordSize(static_cast<UpdateType>(data[0]));
+    if (::read(input, data + 1, size - 1) != size - 1)
+      break;
+    uint32_t hash;
+    memcpy(&hash, data + size - sizeof(hash), sizeof(hash));
+    if (hash != checksum(data, size - sizeof(hash)))
+      break;
+
+    UpdateRecord record;
+    const char *cursor = data;
+    record.type = static_cast<UpdateType>(*cursor++);
+    memcpy(&record.topicId, cursor, sizeof(record.topicId));
+    cursor += sizeof(record.topicId);
+    memcpy(&record.questionId, cursor, sizeof(record.questionId));
+    cursor += sizeof(record.questionId);
+    memcpy(&record.x, cursor, sizeof(record.x));
+    cursor += sizeof(record.x);
+    memcpy(&record.y, cursor, sizeof(record.y));
+    cursor += sizeof(record.y);
+    if (record.type == UPDATE_ADD_TIMED_TOPIC) {
+      memcpy(&record.createdAt, cursor, sizeof(record.createdAt));
+      cursor += sizeof(record.createdAt);
+      memcpy(&record.expiresAt, cursor, sizeof(record.expiresAt));
+    }
+    visit(record);
+    ++count;
+  }
+  ::close(input);
+  return count;
+}
+
+}  // namespace NearbySolver
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Append-only binary log of online index updates.
+ */
+
+#ifndef _UPDATE_LOG_H
+#define _UPDATE_LOG_H
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::function;
+using std::string;
+
+class UpdateRecord;
+class UpdateLog;
+
+enum UpdateType : uint8_t {
+  UPDATE_ADD_TOPIC = 1,
+  UPDATE_MOVE_TOPIC = 2,
+  UPDATE_LINK_QUESTION = 3,
+  UPDATE_SET_LIFETIME = 4,
+  UPDATE_ADD_TIMED_TOPIC = 5
+};
+
+class UpdateRecord {
+ public:
+  UpdateType type = UPDATE_ADD_TOPIC;
+  int topicId = 0;
+  int questionId = 0;
+  // Coordinates, or for UPDATE_SET_LIFETIME the creation and expiry times.
+  double x = 0.0;
+  double y = 0.0;
+  // Lifetime of the topic of an UPDATE_ADD_TIMED_TOPIC.
+  double createdAt = -std::numeric_limits<double>::infinity();
+  double expiresAt = std::numeric_limits<double>::infinity();
+
+  // Applies the update through addTopic, moveTopic, linkQuestion or
+  // setTopicLifetime.
+  void apply() const;
+};
+
+// Records have a fixed size per type and are checksummed, so a torn write at
+// the tail of a log is detected and ignored on replay. Appends are buffered
+// and written with a single write and fdatasync per group commit.
+class UpdateLog {
+ public:
+  UpdateLog() = default;
+  ~UpdateLog() { close(); }
+  UpdateLog(const UpdateLog&) = delete;
+  UpdateLog& operator= (const UpdateLog&) = delete;
+
+  bool open(const string &path);
+  // Commits and closes the file; returns whether every record reached it.
+  // Records that did not are dropped.
+  bool close();
+  // Moves on to a new file once every buffered record is committed to the
+  // current one, so that no record is split across the two. Returns false,
+  // still on the current file, if the commit fails or the new file cannot
+  // be opened.
+  bool rotate(const string &path);
+  bool isOpen() const { return fd >= 0; }
+  // Buffers the record, committing once a full group has accumulated.
+  // Returns false, with the record left out of the log, if the commit
+  // fails before any of the record is written; once part of it is in the
+  // file, the rest stays buffered like the other records.
+  bool append(const UpdateRecord &record);
+  // Makes every buffered record durable. After a failed write the bytes
+  // not yet written stay buffered, and the next commit continues with them.
+  bool commit();
+
+  // Calls visit for every intact record in order and returns how many were
+  // read, or -1 if the file cannot be opened.
+  static int replay(const string &path,
+                    const function<void(const UpdateRecord&)> &visit);
+
+  static constexpr int RECORD_SIZE = 29;
+  static constexpr int TIMED_RECORD_SIZE = 45;
+  static int recordSize(UpdateType type) {
+    return type == UPDATE_ADD_TIMED_TOPIC ? TIMED_RECORD_SIZE : RECORD_SIZE;
+  }
+  static constexpr int GROUP_COMMIT_RECORDS = 256;
+
+ private:
+  int fd = -1;
+  string buffer;
+};
+
+}  // namespace NearbySolver
+
+#endif  // _UPDATE_LOG_H
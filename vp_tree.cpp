@@ -0,0 +1,26 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Vantage-point tree engine for k-NN queries under an arbitrary metric.
+ *
+ * A KD-Tree prunes a subtree by the distance from the query to its splitting
+ * plane, which is a lower bound on the distance to every point behind it only
+ * for coordinate-wise metrics. A vantage-point tree instead bounds a subtree
+ * by distances to the vantage point alone: with d the distance from the query
+ * to the vantage point, every point at distance r from the vantage point is at
+ * least |d - r| from the query. That needs nothing but the triangle
+ * inequality, so any metric can be plugged in. The engine is built once over
+ * a snapshot of the topics and does not take updates.
+ *
+ * The metrics shipped with the solver are instantiated here.
+ */
+
+#include "./vp_tree.h"
+
+namespace NearbySolver {
+
+constexpr double HaversineMetric::EARTH_RADIUS;
+
+template class VPTree<EuclideanMetric>;
+template class VPTree<HaversineMetric>;
+
+}  // namespace NearbySolver
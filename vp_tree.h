@@ -0,0 +1,224 @@
+/*
+ * Copyright 2015 Evan Limanto
+ * Vantage-point tree engine for k-NN queries under an arbitrary metric.
+ */
+
+#ifndef _VP_TREE_H
+#define _VP_TREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./group_questions.h"
+#include "./nearby.h"
+
+namespace NearbySolver {
+
+using std::numeric_limits;
+using std::unordered_map;
+using std::vector;
+
+template <typename Metric> class VPTree;
+
+// Straight-line distance, the metric the KD-Tree is built around.
+class EuclideanMetric {
+ public:
+  double operator() (double x1, double y1, double x2, double y2) const {
+    return hypot(x1 - x2, y1 - y2);
+  }
+};
+
+// Great-circle distance in kilometers between (longitude, latitude) pairs
+// given in degrees.
+class HaversineMetric {
+ public:
+  static constexpr double EARTH_RADIUS = 6371.0;
+
+  double operator() (double x1, double y1, double x2, double y2) const {
+    const double toRadians = M_PI / 180.0;
+    double sinLatitude = sin((y2 - y1) * toRadians / 2);
+    double sinLongitude = sin((x2 - x1) * toRadians / 2);
+    double a = sinLatitude * sinLatitude + cos(y1 * toRadians) *
+      cos(y2 * toRadians) * sinLongitude * sinLongitude;
+    return 2 * EARTH_RADIUS * asin(std::min(1.0, sqrt(a)));
+  }
+};
+
+// k-NN over the topics for any metric satisfying the triangle inequality,
+// where the axis-aligned pruning of the KD-Tree no longer holds. Each node
+// is a vantage point splitting the rest of its range at the median distance
+// from it; the tree is laid out in one array, a node followed by its inside
+// range and then its outside range. Metric is called as
+// metric(x1, y1, x2, y2) and must be symmetric.
+template <typename Metric>
+class VPTree {
+ public:
+  explicit VPTree(Metric metric = Metric()) : metric(metric) {}
+  ~VPTree() = default;
+  void build(const unordered_map<int, Topic> &allTopics);
+  int size() const { return static_cast<int>(items.size()); }
+  // Same contract as the reentrant KDTree::kNNTopics, with distances
+  // measured by the metric.
+  void kNNTopics(const vector<double> &position, int k,
+                 ResultHeap *results) const;
+  // Same contract as the reentrant KDTree::kNNQuestions: questions go into
+  // the caller's ranking scored by their closest topic under the metric.
+  void kNNQuestions(const vector<double> &position,
+                    GroupQuestions *results) const;
+
+ private:
+  class Item {
+   public:
+    int topicId = 0;
+    double coordinates[2];
+    // Distance from the vantage point splitting inside from outside, and
+    // where the outside range starts.
+    double radius = 0.0;
+    int outsideBegin = 0;
+    // Distance to the parent's vantage point, only used while building.
+    double distance = 0.0;
+  };
+
+  Metric metric;
+  vector<Item> items;
+
+  double distanceTo(const vector<double> &position, const Item &item) const {
+    return metric(position[0], position[1], item.coordinates[0],
+                  item.coordinates[1]);
+  }
+  void build(int begin, int end, std::minstd_rand *random);
+  void kNNTopics(int begin, int end, const vector<double> &position, int k,
+                 ResultHeap *results) const;
+  void kNNQuestions(int begin, int end, const vector<double> &position,
+                    GroupQuestions *results) const;
+};
+
+template <typename Metric>
+void VPTree<Metric>::build(const unordered_map<int, Topic> &allTopics) {
+  items.clear();
+  items.reserve(allTopics.size());
+  for (const auto &entry : allTopics) {
+    Item item;
+    item.topicId = entry.first;
+    item.coordinates[0] = entry.second.getX();
+    item.coordinates[1] = entry.second.getY();
+    items.push_back(item);
+  }
+  // Map order is arbitrary; sort so that the tree depends only on the input.
+  std::sort(items.begin(), items.end(), [](const Item &item1,
+                                           const Item &item2) {
+    return item1.topicId < item2.topicId;
+  });
+  std::minstd_rand random;
+  build(0, size(), &random);
+}
+
+// A random vantage point avoids the worst case of sorted input; the median
+// distance splits the remaining range in half.
+template <typename Metric>
+void VPTree<Metric>::build(int begin, int end, std::minstd_rand *random) {
+  if (begin >= end)
+    return;
+
+  std::swap(items[begin], items[begin + (*random)() % (end - begin)]);
+  Item &vantage = items[begin];
+  for (int i = begin + 1; i < end; ++i) {
+    items[i].distance = metric(vantage.coordinates[0], vantage.coordinates[1],
+                               items[i].coordinates[0],
+                               items[i].coordinates[1]);
+  }
+
+  int middle = begin + 1 + (end - begin - 1) / 2;
+  vantage.outsideBegin = middle;
+  if (middle < end) {
+    std::nth_element(items.begin() + begin + 1, items.begin() + middle,
+                     items.begin() + end, [](const Item &item1,
+                                             const Item &item2) {
+      return item1.distance < item2.distance;
+    });
+    vantage.radius = items[middle].distance;
+  }
+  build(begin + 1, middle, random);
+  build(middle, end, random);
+}
+
+template <typename Metric>
+void VPTree<Metric>::kNNTopics(const vector<double> &position, int k,
+                               ResultHeap *results) const {
+  kNNTopics(0, size(), position, k, results);
+}
+
+// Inside holds distances up to the radius and outside those from it on, so
+// by the triangle inequality a topic within bound of the query can only be
+// inside when distance - bound <= radius, and outside when
+// distance + bound >= radius. Results closer than the bound by no more than
+// EPSILON still tie with it, so both tests allow that much slack.
+template <typename Metric>
+void VPTree<Metric>::kNNTopics(int begin, int end,
+                               const vector<double> &position, int k,
+                               ResultHeap *results) const {
+  if (begin >= end || k <= 0)
+    return;
+
+  const Item &vantage = items[begin];
+  double distance = distanceTo(position, vantage);
+  results->emplace(distance, vantage.topicId);
+  if (static_cast<int>(results->size()) > k)
+    results->pop();
+
+  auto bound = [&]() {
+    return static_cast<int>(results->size()) < k ?
+      numeric_limits<double>::infinity() : results->top().first;
+  };
+  if (distance < vantage.radius) {
+    kNNTopics(begin + 1, vantage.outsideBegin, position, k, results);
+    if (!compareDouble(vantage.radius, distance + bound()))
+      kNNTopics(vantage.outsideBegin, end, position, k, results);
+  } else {
+    kNNTopics(vantage.outsideBegin, end, position, k, results);
+    if (!compareDouble(distance - bound(), vantage.radius))
+      kNNTopics(begin + 1, vantage.outsideBegin, position, k, results);
+  }
+}
+
+template <typename Metric>
+void VPTree<Metric>::kNNQuestions(const vector<double> &position,
+                                  GroupQuestions *results) const {
+  if (results->getNumResults() > 0)
+    kNNQuestions(0, size(), position, results);
+}
+
+template <typename Metric>
+void VPTree<Metric>::kNNQuestions(int begin, int end,
+                                  const vector<double> &position,
+                                  GroupQuestions *results) const {
+  if (begin >= end)
+    return;
+
+  const Item &vantage = items[begin];
+  double distance = distanceTo(position, vantage);
+  for (int questionId : questionIdsOf(vantage.topicId))
+    results->offer(questionId, distance);
+
+  if (distance < vantage.radius) {
+    kNNQuestions(begin + 1, vantage.outsideBegin, position, results);
+    if (!compareDouble(vantage.radius, distance + results->bound()))
+      kNNQuestions(vantage.outsideBegin, end, position, results);
+  } else {
+    kNNQuestions(vantage.outsideBegin, end, position, results);
+    if (!compareDouble(distance - results->bound(), vantage.radius))
+      kNNQuestions(begin + 1, vantage.outsideBegin, position, results);
+  }
+}
+
+extern template class VPTree<EuclideanMetric>;
+extern template class VPTree<HaversineMetric>;
+
+}  // namespace NearbySolver
+
+#endif  // _VP_TREE_H